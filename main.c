@@ -1,6 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* ------------------------------------------------------------------------------------------ constants ------------------------------------------------------------------------------------------ */
 #define CHANGE 'c'
@@ -9,14 +18,56 @@
 #define UNDO 'u'
 #define REDO 'r'
 #define QUIT 'q'
+#define BEGIN_GROUP 'b'
+#define COMMIT_GROUP 'e'
+#define SEARCH 's'
+#define REGEX_SEARCH 'g'
+#define WRITE 'w'
+#define OFFSET 'o'
+#define MARK 'k'
+#define COMPARE '='
+#define BATCH_CHANGE 'm'
+#define JUMP 'j'
 #define FIX_VALUES 'f'
+#define REPLACE 'x' //history only: the text of a line replaced in place, swapped with the one of the tree by undo and redo
+#define SPILLED 'z' //history only: stands for the compressed tail of a redo chain, begin is the index of its segment
 #define POINT '.'
 #define NEWLINE '\n'
 #define RED 'r'
 #define BLACK 'b'
 #define MAXLINESIZE 1024
+#define COMMAND_BATCH_SIZE 256 //maximum number of commands handed from the reader to the engine at once
+#define COMMAND_BATCH_LINES 4096 //a batch is handed over as soon as it holds this many text lines
+#define OUTPUT_CHUNK_SIZE (64*1024)
+#define RING_CAPACITY 64 //slots of every ring buffer of the pipeline, it has to be a power of two
+#define RING_SPINS 64 //polls of a ring before the waiting stage parks until the other side wakes it
+#define CACHE_LINE_SIZE 64
+#define HISTORY_MEMORY_BUDGET (512L*1024*1024) //bytes of undo and redo history kept in memory, it can be overridden with the HISTORY_MEMORY_BUDGET environment variable (0 disables the spill)
+#define HISTORY_HOT_BUDGET (64L*1024*1024) //bytes of uncompressed undo and redo history, it can be overridden with the HISTORY_HOT_BUDGET environment variable (0 disables the compression)
+#define LZ_HASH_BITS 16
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define SEARCH_PARALLEL_LINES 65536 //searches over at least this many lines are split across threads
+#define SEARCH_MAX_THREADS 8
+#define NGRAM_BUCKET_BITS 16 //the trigrams of the n-gram index are hashed in 2^NGRAM_BUCKET_BITS posting lists
+#define SAVE_BATCH_SIZE 1024 //lines written by a single writev
+#define HASH_MODULUS ((1ULL << 61) - 1) //the hashes of the texts are combined as polynomials modulo this prime
+#define HASH_BASE 0x5bd1e9955bd1e99ULL
+#define TRACE_MAGIC "EDTRACE1" //first bytes of a trace file
+#define TRACE_APPLY_DO 'a' //record of the trace for the undo-s and redo-s summed up, applied before the next command of another type: start is the number of levels (undo-s positive, redo-s negative)
+#define FNV_OFFSET 0xcbf29ce484222325ULL //the output of every traced command is hashed with 64 bit FNV-1a
+#define FNV_PRIME 0x100000001b3ULL
+#define KEY_SHIFT_LOG_SIZE 64 //key shifts of deletes that are buffered before being applied to the whole tree
+#define NODE_SLAB_SIZE 4096 //nodes of the tree allocated at once
+#define PRINT_CACHE_SIZE 8 //results of prints kept for the following ones
+#define PRINT_CACHE_MAX_BYTES (1024*1024) //longer prints are not cached
+#define REGEX_STACK_WORDS 4 //the states of regular expressions with more than 255 items are kept on the heap
 
 /* ------------------------------------------------------------------------------------------ Struct definitions ------------------------------------------------------------------------------------------ */
+#ifdef MERKLE_HASH
+typedef unsigned long long hash_t;
+#endif
+
 /**
  * RB-tree node
  */
@@ -26,9 +77,64 @@ typedef struct node_s {
     struct node_s* p;
     int key; //The number of the row is the key of the nodes of the tree
     char* text_line; //Text content of the lines
+    long bytes; //bytes of the texts of the subtree
+#ifdef MERKLE_HASH
+    hash_t line_hash; //hash of the text of the node
+    hash_t hash; //hash of the texts of the subtree, in order: it does not depend on the shape of the tree
+    hash_t power; //HASH_BASE to the number of nodes of the subtree
+#endif
     char col;
+#ifdef NGRAM_INDEX
+    int text_id; //id of the text in the n-gram index
+#endif
 } node_t;
 
+#ifdef NGRAM_INDEX
+/**
+ * Ids of the texts containing a trigram (or another trigram with the same hash)
+ */
+typedef struct posting_list_s {
+    int* ids;
+    int size;
+    int capacity;
+} posting_list_t;
+
+/**
+ * Trigram index of the texts of the tree. The postings of a text that leaves the tree are dropped lazily: its id maps to NULL until the index is compacted
+ */
+typedef struct ngram_index_s {
+    posting_list_t buckets[1 << NGRAM_BUCKET_BITS];
+    struct node_s** nodes; //node containing the text of every id
+    int* id_postings; //number of postings of every id
+    int nodes_size;
+    int nodes_capacity;
+    int* free_ids;
+    int free_ids_size;
+    int free_ids_capacity;
+    int* dead_ids; //ids still referenced by postings
+    int dead_ids_size;
+    int dead_ids_capacity;
+    long live_postings;
+    long dead_postings;
+} ngram_index_t;
+#endif
+
+/**
+ * Block of nodes of a tree. The nodes are never freed one by one: the deleted ones go on a free list, all the blocks are freed together with the tree
+ */
+typedef struct node_slab_s {
+    struct node_slab_s* next;
+    node_t nodes[NODE_SLAB_SIZE];
+} node_slab_t;
+
+/**
+ * Shift of the keys caused by a delete: the keys from start+width on are decreased by width
+ */
+typedef struct key_shift_s {
+    int start;
+    int width;
+} key_shift_t;
+
 /**
  * RB-tree
  */
@@ -36,8 +142,55 @@ typedef struct tree_s {
     node_t* root;
     node_t* nil;
     int number_of_keys;
+    key_shift_t pending_shifts[KEY_SHIFT_LOG_SIZE]; //shifts not yet applied to the keys of the nodes, oldest first
+    int pending_shifts_size;
+    unsigned long shifts_applied; //times the logged shifts have been applied to the nodes, changing their keys
+    node_slab_t* slabs; //the first one is the one being filled
+    int slab_used; //nodes of the first slab handed out
+    node_t* free_nodes; //deleted nodes, linked by their right child
+#ifdef NGRAM_INDEX
+    ngram_index_t* index;
+#endif
 } tree_t;
 
+#ifdef MERKLE_HASH
+/**
+ * Hashes of the lines of a version of the document, enough to compare it with the tree
+ */
+typedef struct version_s {
+    hash_t* prefix; //prefix[i] is the hash of the first i lines
+    hash_t* powers; //powers[i] is HASH_BASE to the i
+    int size; //number of lines
+    int capacity;
+} version_t;
+#endif
+
+/**
+ * Regular expression made of characters, '.', '*', '^' and '$', compiled in sets of bits: one bit per item (a character or '.', repeated if followed
+ * by '*'), the bit after the last item marks a match
+ */
+typedef struct compiled_regex_s {
+    int size; //number of items
+    int words; //64 bit words of every set
+    int anchored; //true if the expression starts with '^'
+    int at_end; //true if the expression ends with '$'
+    char first; //first item when a match can only start at it (a character not repeated), 0 otherwise
+    uint64_t* stars; //items repeated by '*'
+    uint64_t* masks; //for every byte, the items matching it
+} compiled_regex_t;
+
+/**
+ * Slice of the lines checked by a thread of a search
+ */
+typedef struct search_job_s {
+    char** text_lines;
+    char* matches; //true for every line that matches
+    int size;
+    const char* pattern;
+    long pattern_length;
+    const compiled_regex_t* regex; //NULL if pattern is a substring
+} search_job_t;
+
 /**
  * Node of a list of commands used to implement a stack
  */
@@ -46,6 +199,8 @@ typedef struct list_of_commands_s{
     int end;
     int command_id;
     char command;
+    char owned; //true if text_line is referenced only by this command, so it can be freed when the command is spilled
+    short length; //length of text_line, counted only if owned
     char* text_line;
     struct list_of_commands_s* next;
 } list_of_commands_t;
@@ -56,8 +211,241 @@ typedef struct list_of_commands_s{
 typedef struct stack_s{
     list_of_commands_t* top;
     int size;
+    long bytes; //memory used by the commands in the stack
 }stack_t;
 
+/**
+ * Group of the oldest undo levels, or of the last levels of a redo chain, serialized and compressed
+ */
+typedef struct spill_segment_s{
+    char* data; //compressed commands, NULL if the segment is in the spill file
+    long offset; //position in the spill file, next free slot for a free redo segment
+    long size; //compressed size
+    long raw_size;
+} spill_segment_t;
+
+/**
+ * Counters of the cold history, printed by editor_print_stats
+ */
+typedef struct history_stats_s{
+    long segments_compressed;
+    long raw_bytes;
+    long compressed_bytes;
+    long segments_written;
+    long segments_restored;
+    long restore_ns; //time spent reading back and decompressing segments
+    long max_restore_ns;
+} history_stats_t;
+
+/**
+ * Redo chain set aside by an edit made after some undo-s. Its first level is a child of the fork level, every other level is a child of the previous one
+ */
+typedef struct branch_s{
+    list_of_commands_t* top; //NULL if the slot is free
+    int size; //number of levels
+    long bytes;
+} branch_t;
+
+/**
+ * Cold part of the history. The undo segments are a stack too: the last one compressed is the first one read back. The oldest segments are moved in the spill file, the newest ones stay in memory.
+ * The redo segments are the tails of the redo stack and of the branches, each one stands in its chain as a SPILLED command: they are read back when a redo reaches them, in any order, so they have a file of their own
+ */
+typedef struct history_spill_s{
+    int fd; //-1 until the first segment is written
+    long budget; //bytes of hot and compressed history kept in memory
+    long hot_budget; //bytes of uncompressed history
+    long cold_bytes; //bytes of the compressed segments kept in memory
+    long file_size;
+    spill_segment_t* segments;
+    int segments_size;
+    int segments_capacity;
+    int segments_in_file; //the segments from 0 to segments_in_file-1 are in the spill file
+    int chain_fd; //file of the redo segments, -1 until the first one is written
+    long chain_file_size; //the file only grows: the space of the segments read back is not reused
+    spill_segment_t* chains; //redo segments
+    int chains_size;
+    int chains_capacity;
+    int free_chain; //first free slot of chains, -1 if none
+    long undo_kept; //bytes left in the undo stack by the last compression: the next one waits until the stack has grown by half of the hot budget
+    long redo_kept; //the same for the redo stack, by a quarter of the hot budget
+    history_stats_t stats;
+} history_spill_t;
+
+/**
+ * Command read from the input, already tokenized
+ */
+typedef struct command_s{
+    int start;
+    int end;
+    char command;
+    int first_line; //index in the text_lines of the batch of the first line of a change command
+    long long arrival_ns; //time at which the command has been read, only if the commands are traced
+} command_t;
+
+/**
+ * Group of consecutive commands together with the text lines of their change commands
+ */
+typedef struct command_batch_s{
+    command_t commands[COMMAND_BATCH_SIZE];
+    int size;
+    char** text_lines;
+    int* text_addresses; //address of every text line of a batch change command
+    int text_lines_size;
+    int text_lines_capacity;
+} command_batch_t;
+
+/**
+ * Change of a single line in a batch change
+ */
+typedef struct edit_s{
+    int address;
+    int order; //position in the batch: the last change of a line wins
+    char* text_line;
+} edit_t;
+
+/**
+ * State of the tokenizer: addresses are kept between commands like scanf did with its variables
+ */
+typedef struct reader_s{
+    int start;
+    int end;
+    int timestamps; //true if the arrival time of the commands is taken
+} reader_t;
+
+#ifdef PIPELINE
+/**
+ * Lock-free single producer single consumer ring buffer of pointers. A stage that finds it empty (or full) polls it for a while, then sleeps until the
+ * other side moves
+ */
+typedef struct ring_s{
+    void* slots[RING_CAPACITY];
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE))); //written only by the consumer
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE))); //written only by the producer
+    int parked __attribute__((aligned(CACHE_LINE_SIZE))); //true while a stage sleeps waiting for the other side
+    pthread_mutex_t lock; //protects the sleep of the parked stage
+    pthread_cond_t wake;
+} ring_t;
+
+/**
+ * Rings connecting the reader, the engine and the writer. Every forward ring has a matching ring used to give back the emptied buffers
+ */
+typedef struct pipeline_s{
+    ring_t full_batches;
+    ring_t free_batches;
+    ring_t full_chunks;
+    ring_t free_chunks;
+    int timestamps; //true if the reader takes the arrival time of the commands
+    int interactive; //true if the reader hands over every command as soon as it is read
+} pipeline_t;
+#endif
+
+/**
+ * Buffer in which the output of the print commands is formatted
+ */
+typedef struct output_s{
+    char* buffer;
+    size_t size;
+    int interactive; //the buffer is flushed after every print when the output is a terminal
+    int traced; //true if the output of every command is hashed
+    size_t trace_offset; //bytes of the buffer already hashed
+    unsigned long long trace_hash; //hash of the output of the current command
+    long long trace_bytes;
+#ifdef PIPELINE
+    pipeline_t* pipeline;
+#endif
+} output_t;
+
+/**
+ * Output of a print, kept until the document changes. The range starts at a valid address
+ */
+typedef struct print_entry_s{
+    unsigned long version; //version of the document printed
+    int start;
+    int end; //0 if the entry is empty
+    char* buffer; //NULL if the range has been requested only once
+    size_t size;
+    size_t* offsets; //offset in the buffer of every line of the range, followed by the size of the buffer
+    int offsets_capacity;
+} print_entry_t;
+
+/**
+ * Recent prints: a print contained in the range of an entry of the current version is served slicing its buffer
+ */
+typedef struct print_cache_s{
+    print_entry_t entries[PRINT_CACHE_SIZE];
+    int next; //entry replaced by the next miss
+    long hits;
+    long misses;
+} print_cache_t;
+
+/**
+ * Binary trace of the commands received, written when the EDITOR_TRACE environment variable names a file
+ */
+typedef struct trace_s{
+    FILE* file; //NULL if the commands are not traced
+    char* texts; //text lines of the command being executed, serialized before the tree takes them
+    size_t texts_size;
+    size_t texts_capacity;
+} trace_t;
+
+/**
+ * Fixed part of a record of the trace, followed by its text lines. Every line is written as its length (short) and its bytes, preceded by its address (int)
+ * in a batch change
+ */
+typedef struct trace_record_s{
+    char command;
+    int start;
+    int end;
+    int lines;
+    long long arrival_ns;
+    long long completion_ns;
+    long long output_bytes;
+    unsigned long long output_hash;
+} trace_record_t;
+
+/**
+ * Hash table from the stored key of a line to the command that undoes its last change in the open group
+ */
+typedef struct line_map_s{
+    int* keys; //0 marks an empty slot, keys start from 1
+    list_of_commands_t** values;
+    int size;
+    int capacity; //power of two
+} line_map_t;
+
+/**
+ * Text, history and pending undo/redo commands of the editor
+ */
+typedef struct editor_s{
+    tree_t* t;
+    stack_t* undo_stack;
+    stack_t* redo_stack;
+    int command_id;
+    int do_pending; //true if undo/redo commands have been read but not applied yet
+    int start_do; //variable used to implement an "algebraic sum" between undo-s and redo-s in order to speed up the undo/redo commands
+    int temporary_undo_stack_size;
+    int temporary_redo_stack_size;
+    int group_depth; //number of begin markers not yet committed
+    int group_edits; //changes and deletes in the open group
+    line_map_t group_lines; //lines changed in the open group, by stored key: the logged shifts of its deletes do not move them
+    unsigned long group_lines_shifts; //shifts_applied of the tree when the keys of group_lines were taken
+    history_spill_t history;
+    int level; //undo level of the current version of the document, 0 before the first edit
+    int* level_parent; //parent of every level in the undo tree, indexed by command id
+    int* level_depth;
+    int* level_branch; //branch holding a level that is neither undone nor redone, meaningful only for the first level of a branch
+    int levels_capacity;
+    branch_t* branches;
+    int branches_size;
+    trace_t trace;
+    output_t output;
+    unsigned long version; //incremented by every command that can change the document
+    print_cache_t prints;
+#ifdef MERKLE_HASH
+    version_t mark; //version saved by the last mark command
+#endif
+} editor_t;
+
 /* ------------------------------------------------------------------------------------------ trees prototypes ------------------------------------------------------------------------------------------ */
 /**
  * Initializes the tree
@@ -66,11 +454,10 @@ typedef struct stack_s{
 void tree_create(tree_t* t);
 
 /**
- * Destroys a subtree of a tree
- * @param t tree in which the subtree is contained
- * @param node root of the subtree to destroy
+ * Frees all the nodes of a tree a slab at a time, leaving it empty. The texts are not freed: the history may still refer to them
+ * @param t tree to destroy
  */
-void destroy_subtree(tree_t* t, node_t* node);
+void tree_destroy(tree_t* t);
 
 /**
  * Looks up for the node with the key given in input
@@ -105,10 +492,11 @@ node_t* make_node_nil();
 void tree_insert(tree_t* t, int key, char* text_line, int command_id, stack_t* s);
 
 /**
- * Destroys a node of a tree
+ * Destroys a node of a tree, putting it on the free list of the tree
+ * @param t tree containing the node
  * @param n node to destroy
  */
-void destroy_tree_node(node_t* n);
+void destroy_tree_node(tree_t* t, node_t* n);
 /**
  * Deletes a node of a tree
  * @param t tree in which there is the node do delete
@@ -119,13 +507,81 @@ void destroy_tree_node(node_t* n);
 void tree_delete(tree_t* t, node_t* x, int command_id, stack_t* s);
 
 /**
- * Fixes the nodes of the tree in order to satisfy RB-trees properties after it has been modified
+ * Fixes the keys of the nodes that follow the lines removed by a delete
  * @param t tree
- * @param x root of the tree
  * @param start initial address of the command
  * @param end ending address of the command
  */
-void tree_key_fixup (tree_t* t, node_t *x, int start, int end);
+void tree_key_fixup (tree_t* t, int start, int end);
+
+/**
+ * Insertion shared by tree_insert and tree_insert_from_do. It is inlined in both with a constant record, so neither of them branches on it
+ * @param t tree in which the node will be added
+ * @param key address of the line, recorded in the history
+ * @param stored_key key of the node
+ * @param text_line text of the node
+ * @param command_id id of the command recorded in the history
+ * @param s undo stack in which the command is recorded
+ * @param record true if the insertion is recorded in the history
+ */
+static inline __attribute__((always_inline)) void tree_insert_core(tree_t* t, int key, int stored_key, char* text_line, int command_id, stack_t* s, const int record);
+
+/**
+ * Deletion shared by tree_delete and tree_delete_from_do, inlined with a constant record like tree_insert_core
+ * @param t tree in which there is the node do delete
+ * @param x node to delete, NULL if the line is not in the tree
+ * @param command_id id of the command recorded in the history
+ * @param s undo stack in which the command is recorded
+ * @param record true if the deletion is recorded in the history
+ */
+static inline __attribute__((always_inline)) void tree_delete_core(tree_t* t, node_t* x, int command_id, stack_t* s, const int record);
+
+/**
+ * Shift of the keys shared by tree_key_fixup and tree_key_fixup_from_do, inlined with a constant direction
+ * @param t tree
+ * @param start initial address of the delete
+ * @param end ending address of the delete
+ * @param direction -1 to remove the lines of the delete from the keys, 1 to make room for them again
+ */
+static inline __attribute__((always_inline)) void tree_key_fixup_core(tree_t* t, int start, int end, const int direction);
+
+/**
+ * Logs the shift of the keys caused by a delete, without touching the nodes. The shifts are applied all together by tree_apply_key_shifts
+ * @param t tree
+ * @param start initial address of the delete
+ * @param end ending address of the delete
+ */
+void tree_log_key_shift(tree_t* t, int start, int end);
+
+/**
+ * Applies all the logged shifts with a single walk of the tree. It has to be called before reading the keys of the nodes
+ * @param t tree
+ */
+void tree_apply_key_shifts(tree_t* t);
+
+/**
+ * Translates an address into the key that the node with that address has while there are shifts not yet applied
+ * @param t tree
+ * @param key address of the line
+ * @return the key stored in the node
+ */
+int tree_stored_key(tree_t* t, int key);
+
+/**
+ * Translates the key stored in a node into the address of the line while there are shifts not yet applied
+ * @param t tree
+ * @param key key stored in the node
+ * @return the address of the line
+ */
+int tree_line_address(tree_t* t, int key);
+
+/**
+ * Replaces the text of a node
+ * @param t tree
+ * @param x node
+ * @param text_line new text of the node
+ */
+void tree_set_text(tree_t* t, node_t* x, char* text_line);
 
 /**
  * Fixes the nodes of the tree in order to satisfy RB-trees properties after an insertion
@@ -171,6 +627,14 @@ node_t* tree_minimum(tree_t* t, node_t* x);
  */
 node_t* tree_maximum (tree_t* t, node_t* x);
 
+/**
+ * Retrieves the first node with a key not smaller than the one given in input
+ * @param t tree
+ * @param key key
+ * @return the node, NIL if all the keys are smaller
+ */
+node_t* tree_lower_bound(tree_t* t, int key);
+
 /**
  * Retrieves the node containing the successor value of the one given in input
  * @param t tree in which the lookup has to be performed
@@ -187,6 +651,89 @@ node_t* tree_successor(tree_t* t, node_t* x);
  */
 node_t* tree_predecessor(tree_t* t, node_t* x);
 
+/**
+ * Adds a number of bytes to the byte counts of a node and of its ancestors
+ * @param t tree
+ * @param x node
+ * @param bytes bytes to add, negative to remove them
+ */
+void tree_add_bytes(tree_t* t, node_t* x, long bytes);
+
+/**
+ * @param t tree
+ * @return the bytes of the whole document
+ */
+long tree_bytes(tree_t* t);
+
+/**
+ * Finds the line containing a byte of the document, descending the tree by the byte counts of the subtrees
+ * @param t tree
+ * @param offset offset of the byte from the beginning of the document
+ * @return the address of the line, 0 if the offset is outside the document
+ */
+int tree_offset_line(tree_t* t, long offset);
+
+/**
+ * Writes the whole document to a file, allocating its size first and writing many lines with every system call
+ * @param t tree
+ * @param path name of the file
+ * @return the bytes written, -1 if the file cannot be written
+ */
+long tree_save(tree_t* t, const char* path);
+
+/**
+ * Replaces many lines of the tree in a single walk, descending only the subtrees that contain an address of the batch. Every line is recorded as a single REPLACE command
+ * @param t tree
+ * @param edits changes sorted by address, at most one per address and all of them inside the document
+ * @param size number of changes
+ * @param command_id id of the command in the history
+ * @param s undo stack
+ */
+void tree_batch_change(tree_t* t, edit_t* edits, int size, int command_id, stack_t* s);
+
+#ifdef MERKLE_HASH
+/**
+ * @param text text of a line
+ * @return the hash of the text, never 0
+ */
+hash_t hash_text(const char* text);
+
+/**
+ * Recomputes the hash of a node from the ones of its children
+ * @param x node
+ */
+void tree_update_hash(node_t* x);
+
+/**
+ * Recomputes the hashes of a node and of its ancestors
+ * @param t tree
+ * @param x node
+ */
+void tree_fix_hashes(tree_t* t, node_t* x);
+
+/**
+ * @param t tree
+ * @return the hash of the whole document: equal documents have equal hashes, whatever the shape of their trees
+ */
+hash_t tree_hash(tree_t* t);
+
+/**
+ * Saves the hashes of the lines of the document, so that it can be compared later with another version
+ * @param t tree
+ * @param v version to fill
+ */
+void tree_version_take(tree_t* t, version_t* v);
+
+/**
+ * Finds the lines that differ between the document and a saved version, descending only the subtrees whose hash differs from the one of the same lines of the version
+ * @param t tree
+ * @param v version
+ * @param lines set to a new array with the differing addresses in increasing order, to be freed by the caller
+ * @return the number of differing lines, 0 if the document is equal to the version
+ */
+int tree_version_diff(tree_t* t, version_t* v, int** lines);
+#endif
+
 /* ------------------------------------------------------------------------------------------ stack prototypes ------------------------------------------------------------------------------------------ */
 /**
  * Initializes a stack
@@ -230,6 +777,84 @@ void stack_push_values (stack_t* s, int begin, int end, int command_id, char com
  */
 void stack_push_node(stack_t* s, list_of_commands_t* node);
 
+/**
+ * Memory used by a command of a stack
+ * @param node command
+ * @return the number of bytes
+ */
+long stack_node_bytes(list_of_commands_t* node);
+
+/**
+ * Initializes the cold part of the undo history
+ * @param h spill to initialize
+ * @param budget bytes of hot and compressed history kept in memory, 0 never writes the spill file
+ * @param hot_budget bytes of uncompressed history, 0 never compresses. It is cut to half of the memory budget
+ */
+void history_spill_create(history_spill_t* h, long budget, long hot_budget);
+
+/**
+ * Compresses the oldest levels of the undo stack when the stack is over the hot budget. Whole levels (commands with the same command_id) are compressed, until half of the hot budget is left uncompressed.
+ * The redo stack has half of the hot budget: above it, its last levels are compressed by history_spill_chain, until a quarter of the hot budget is left.
+ * Then moves the oldest compressed segments in the spill file while the history is over the memory budget
+ * @param h spill of the history
+ * @param undo_stack undo stack
+ * @param redo_stack redo stack
+ */
+void history_spill(history_spill_t* h, stack_t* undo_stack, stack_t* redo_stack);
+
+/**
+ * Compresses the levels of a redo chain (the redo stack or a branch) that follow its first bytes, up to the first level already compressed. They are replaced by a SPILLED command, which is written in the spill file unless the spill is disabled.
+ * The changes to redo are saved without their text: redo_command takes it from the tree
+ * @param h spill of the history
+ * @param top first command of the chain
+ * @param bytes memory used by the chain, updated
+ * @param keep bytes left uncompressed at the top of the chain, rounded up to whole levels: the first level is always kept
+ */
+void history_spill_chain(history_spill_t* h, list_of_commands_t* top, long* bytes, long keep);
+
+/**
+ * Frees the compressed segments and closes the spill file
+ * @param h cold history
+ */
+void history_spill_destroy(history_spill_t* h);
+
+/**
+ * Decompresses the last segment (reading it back from the spill file if needed) when the undo stack has been emptied by the undo commands
+ * @param h spill of the history
+ * @param s undo stack
+ */
+void history_page_in(history_spill_t* h, stack_t* s);
+
+/**
+ * Decompresses the redo segment at the top of the redo stack (reading it back from the spill file if needed), so that the next level can be redone
+ * @param h spill of the history
+ * @param s redo stack
+ */
+void history_page_in_chain(history_spill_t* h, stack_t* s);
+
+/**
+ * Compresses a buffer with a byte oriented LZ77 codec (literal runs and matches within the last 64 KiB)
+ * @param src buffer to compress
+ * @param size bytes of src
+ * @param dst destination, at least lz_compress_bound(size) bytes
+ * @return the bytes written in dst
+ */
+long lz_compress(const char* src, long size, char* dst);
+
+/**
+ * @return the maximum size of a buffer of the given size once compressed
+ */
+long lz_compress_bound(long size);
+
+/**
+ * Decompresses a buffer compressed by lz_compress
+ * @param src compressed buffer
+ * @param size bytes of src
+ * @param dst destination, as big as the original buffer
+ * @return the bytes written in dst
+ */
+long lz_decompress(const char* src, long size, char* dst);
+
 /**
  * Performs an undo operation. Adds an element in the redo stack
  * @param t tree
@@ -246,6 +871,13 @@ void undo_command (tree_t* t, stack_t* undo_stack, stack_t* redo_stack);
  */
 void redo_command (tree_t* t, stack_t* undo_stack, stack_t* redo_stack);
 
+/**
+ * Undoes or redoes a REPLACE command, swapping its text with the one of the line in the tree
+ * @param t tree
+ * @param replace command, already popped from its stack
+ */
+void history_swap_text(tree_t* t, list_of_commands_t* replace);
+
 /**
  * Inserts an element in the tree after an undo/redo operation
  * @param t tree in which the insertion will be performed
@@ -262,92 +894,493 @@ void tree_insert_from_do(tree_t* t, int key, char* text_line);
 void tree_delete_from_do(tree_t* t, node_t* x);
 
 /**
- * Performs a fixup of the tree after an undo/redo operation
+ * Performs a fixup of the keys after the undo of a delete, making room for its lines
  * @param t tree to fix
- * @param x node from which the fixup will be applied
  * @param start beginning of the command
  * @param end  ending of the command
  */
-void tree_key_fixup_from_do (tree_t* t, node_t *x, int start, int end);
-
-/* ------------------------------------------------------------------------------------------ other prototypes ------------------------------------------------------------------------------------------ */
+void tree_key_fixup_from_do (tree_t* t, int start, int end);
 
+/* ------------------------------------------------------------------------------------------ search prototypes ------------------------------------------------------------------------------------------ */
 /**
- * Performs an in-order-tree-walk and prints the text_values of the tree
- * @param t tree to print
- * @param x root of the tree
- * @param start first value to print
- * @param end last value to print
+ * Looks for the lines of an address range that contain a substring or match a simple regular expression. Big ranges are split across threads, and the
+ * substring searches use the n-gram index when it is compiled in
+ * @param t tree
+ * @param start first address
+ * @param end last address
+ * @param pattern substring, or regular expression made of characters, '.', '*', '^' and '$'
+ * @param is_regex true if pattern is a regular expression
+ * @param matches set to a new array with the matching addresses in increasing order, to be freed by the caller
+ * @return the number of matching lines
  */
-void in_order_iterative (tree_t * t, node_t* x, int start, int end);
-/* ------------------------------------------------------------------------------------------ functions ------------------------------------------------------------------------------------------ */
-int min(int a, int b)
-{
-    if (a < b)
-        return a;
-    return b;
-}
+int tree_find(tree_t* t, int start, int end, const char* pattern, int is_regex, int** matches);
 
-node_t* make_tree_node(tree_t* t, int key, char* text_line) //node creation
-{
-    node_t* n = (node_t*) malloc(sizeof(node_t));
-    n->col = RED;
-    n->p = t->nil;
-    n->left = t->nil;
-    n->right = t->nil;
-    n->key = key;
-    n->text_line = text_line; //"copies" the text in the text_line field of the node
+/**
+ * Looks for a substring in a text, comparing 16 positions at a time when SSE2 is available
+ * @param text text
+ * @param length bytes of the text
+ * @param pattern substring
+ * @param pattern_length bytes of the substring
+ * @return the first occurrence of the substring, NULL if absent
+ */
+const char* text_find(const char* text, long length, const char* pattern, long pattern_length);
 
-    return n;
-}
+/**
+ * Compiles a regular expression made of characters, '.', '*', '^' and '$'
+ * @param r compiled expression to fill, to be freed with regex_free
+ * @param re regular expression
+ */
+void regex_compile(compiled_regex_t* r, const char* re);
 
-void destroy_tree_node(node_t* n)
-{
-    free(n);
-}
+/**
+ * Checks a text against a compiled regular expression. The text is read once, keeping the set of the prefixes of the expression matched so far,
+ * so the time is bounded by the length of the text times the one of the expression. Many threads can use the same expression
+ * @param r compiled expression
+ * @param text text
+ * @param length bytes of the text
+ * @return true if a part of the text matches
+ */
+int regex_match(const compiled_regex_t* r, const char* text, long length);
 
-node_t* make_node_nil() //nil-node creation
-{
-    node_t* nil = (node_t*) malloc(sizeof(node_t));
-    nil->col = BLACK;
-    nil->key = -1;
-    nil-> p = NULL;
-    nil->left = NULL;
-    nil->right = NULL;
+/**
+ * Frees the sets of a compiled regular expression
+ * @param r compiled expression
+ */
+void regex_free(compiled_regex_t* r);
 
-    return nil;
-}
+#ifdef NGRAM_INDEX
+/**
+ * Creates an empty n-gram index
+ * @return the index created
+ */
+ngram_index_t* ngram_index_create();
 
-void tree_create(tree_t* t)
-{
-    t->nil = make_node_nil();
-    t->root = t->nil; //at the beginning root and NIL coincide
-    t->number_of_keys = 0;
-}
+/**
+ * Frees an n-gram index
+ * @param index index
+ */
+void ngram_index_destroy(ngram_index_t* index);
 
-void destroy_subtree(tree_t* t, node_t* node)
+/**
+ * Adds the text of a node to the index
+ * @param index index
+ * @param x node
+ */
+void ngram_index_add(ngram_index_t* index, node_t* x);
+
+/**
+ * Removes the text of a node from the index
+ * @param index index
+ * @param x node
+ */
+void ngram_index_remove(ngram_index_t* index, node_t* x);
+
+/**
+ * Records that the text of a node has been moved to another node
+ * @param index index
+ * @param from node that contained the text
+ * @param to node that contains the text
+ */
+void ngram_index_move(ngram_index_t* index, node_t* from, node_t* to);
+#endif
+
+/* ------------------------------------------------------------------------------------------ input prototypes ------------------------------------------------------------------------------------------ */
+/**
+ * Creates an empty batch of commands
+ * @return the batch created
+ */
+command_batch_t* batch_create();
+
+/**
+ * Empties a batch so that it can be filled again. The text lines are owned by the tree, so they are not freed
+ * @param b batch to empty
+ */
+void batch_clear(command_batch_t* b);
+
+/**
+ * Frees a batch. The text lines are owned by the tree, so they are not freed
+ * @param b batch to free
+ */
+void batch_destroy(command_batch_t* b);
+
+/**
+ * Reads and tokenizes the next command from stdin, adding it (and the text lines of a change command) to the batch
+ * @param r state of the tokenizer
+ * @param b batch in which the command is added
+ * @return the type of the command read, QUIT at the end of the input
+ */
+char read_command(reader_t* r, command_batch_t* b);
+
+/* ------------------------------------------------------------------------------------------ output prototypes ------------------------------------------------------------------------------------------ */
+/**
+ * Initializes the output buffer
+ * @param out output to initialize
+ */
+void output_create(output_t* out);
+
+/**
+ * Appends a line of text to the output
+ * @param out output
+ * @param text_line line to append, including its newline
+ */
+void output_line(output_t* out, char* text_line);
+
+/**
+ * Appends a line with a non negative number
+ * @param out output
+ * @param n number
+ */
+void output_number(output_t* out, long n);
+
+/**
+ * Appends the line printed for an address that has no text
+ * @param out output
+ */
+void output_empty_line(output_t* out);
+
+/**
+ * Hands the content of the buffer to stdout (or to the writer thread of the pipeline)
+ * @param out output to flush
+ */
+void output_flush(output_t* out);
+
+/**
+ * Adds bytes to the output. Bytes that do not fit in a chunk are written at once, unless the output goes through the pipeline or is traced
+ * @param out output
+ * @param data bytes to add
+ * @param size number of bytes
+ */
+void output_bytes(output_t* out, const char* data, size_t size);
+
+/* ------------------------------------------------------------------------------------------ trace prototypes ------------------------------------------------------------------------------------------ */
+/**
+ * Reads the monotonic clock
+ * @return nanoseconds from an arbitrary point in the past
+ */
+long long monotonic_ns();
+
+/**
+ * Counts the text lines read with a command
+ * @param cmd command
+ * @return number of text lines following the command in the input
+ */
+int command_text_lines(command_t* cmd);
+
+/**
+ * Opens the trace file, writing its header
+ * @param tr trace
+ * @param path name of the file, NULL if the commands are not traced
+ */
+void trace_open(trace_t* tr, const char* path);
+
+/**
+ * Hashes the bytes appended to the output since the last call
+ * @param out output
+ */
+void output_trace(output_t* out);
+
+/**
+ * Reads a record of a trace, the file position has to be after the header
+ * @param f trace file
+ * @param record fixed part of the record
+ * @param b batch in which the command is read, with a private copy of its text lines
+ * @return true if a record has been read, false at the end of the trace
+ */
+int trace_read_record(FILE* f, trace_record_t* record, command_batch_t* b);
+
+/* ------------------------------------------------------------------------------------------ editor prototypes ------------------------------------------------------------------------------------------ */
+/**
+ * Initializes an editor with an empty text and an empty history
+ * @param e editor to initialize
+ */
+void editor_create(editor_t* e);
+
+/**
+ * Frees the text and the whole history of an editor: the undo and redo stacks, the branches and the cold segments. The editor can be created again
+ * with editor_create to start over with an empty document. Every text is visited, so the editor does not call it at exit
+ * @param e editor to destroy
+ */
+void editor_destroy(editor_t* e);
+
+/**
+ * Executes a command. Undo/redo commands are only summed up and applied when the next command of another type arrives
+ * @param e editor
+ * @param b batch containing the command (and its text lines)
+ * @param cmd command to execute
+ */
+void editor_execute(editor_t* e, command_batch_t* b, command_t* cmd);
+
+/**
+ * Executes a command like editor_execute, writing its record in the trace if the commands are traced. When the command applies the pending undo-s and redo-s,
+ * they are applied first and get a TRACE_APPLY_DO record of their own, and the command arrives when they have been applied
+ * @param e editor
+ * @param b batch containing the command (and its text lines)
+ * @param cmd command to execute
+ */
+void editor_execute_traced(editor_t* e, command_batch_t* b, command_t* cmd);
+
+/**
+ * Applies the undo/redo commands summed up by editor_execute
+ * @param e editor
+ */
+void editor_apply_do(editor_t* e);
+
+/**
+ * Opens a group of commands: all the changes and deletes until the matching editor_commit_group are undone and redone as a single command. Groups can be nested, only the outermost one counts
+ * @param e editor
+ */
+void editor_begin_group(editor_t* e);
+
+/**
+ * Closes a group of commands opened by editor_begin_group
+ * @param e editor
+ */
+void editor_commit_group(editor_t* e);
+
+/**
+ * Changes a line inside an open group. A line changed again by the group only updates the command of its previous change, so the history keeps one text per line
+ * @param e editor
+ * @param key address of the line
+ * @param text_line new text of the line
+ */
+void editor_group_insert(editor_t* e, int key, char* text_line);
+
+/**
+ * Changes many scattered lines as a single command: the changes are sorted, the ones inside the document are applied in one walk of the tree and the others
+ * are appended
+ * @param e editor
+ * @param edits changes, in the order in which they have been given
+ * @param size number of changes
+ */
+void editor_batch_change(editor_t* e, edit_t* edits, int size);
+
+/**
+ * Adds the undo level of the command just executed as a child of the current level
+ * @param e editor
+ */
+void editor_add_level(editor_t* e);
+
+/**
+ * Sets the redo stack aside as a branch of the undo tree, instead of discarding it
+ * @param e editor
+ */
+void editor_stash_redo(editor_t* e);
+
+/**
+ * Undoes the level on top of the undo stack
+ * @param e editor
+ */
+void editor_undo_level(editor_t* e);
+
+/**
+ * Redoes the level on top of the redo stack
+ * @param e editor
+ */
+void editor_redo_level(editor_t* e);
+
+/**
+ * Brings the document to the version right after a level of the undo tree, undoing up to the lowest common ancestor with the current level and redoing down
+ * from it. The branches left are kept
+ * @param e editor
+ * @param target level, 0 for the empty document
+ */
+void editor_jump(editor_t* e, int target);
+
+/**
+ * Moves the document to a new version, freeing the prints cached for the old one
+ * @param e editor
+ */
+void editor_new_version(editor_t* e);
+
+/**
+ * Prints the lines of a range, reusing the output of a previous print of the same version of the document when it contains the range.
+ * A range is formatted in the cache only the second time it is requested, the first time it goes straight to the output
+ * @param e editor
+ * @param start first address, at least 1
+ * @param end last address, at least start
+ */
+void editor_print(editor_t* e, int start, int end);
+
+/**
+ * Prints the counters of the editor. They are printed on stderr at the end of the input if the EDITOR_STATS environment variable is set
+ * @param e editor
+ * @param f file in which the counters are printed
+ */
+void editor_print_stats(editor_t* e, FILE* f);
+
+#ifdef PIPELINE
+/* ------------------------------------------------------------------------------------------ pipeline prototypes ------------------------------------------------------------------------------------------ */
+/**
+ * Initializes a ring buffer
+ * @param r ring to initialize
+ */
+void ring_create(ring_t* r);
+
+/**
+ * Frees the synchronization objects of a ring
+ * @param r ring
+ */
+void ring_destroy(ring_t* r);
+
+/**
+ * Adds an element to a ring, waiting for a free slot if the ring is full. Only one thread may push
+ * @param r ring
+ * @param item element to add
+ */
+void ring_push(ring_t* r, void* item);
+
+/**
+ * Removes the oldest element of a ring, waiting for one if the ring is empty. Only one thread may pop
+ * @param r ring
+ * @return the element removed
+ */
+void* ring_pop(ring_t* r);
+
+/**
+ * Adds an element to a ring without waiting
+ * @param r ring
+ * @param item element to add
+ * @return true if the element has been added, false if the ring is full
+ */
+int ring_try_push(ring_t* r, void* item);
+
+/**
+ * Removes the oldest element of a ring without waiting
+ * @param r ring
+ * @return the element removed, NULL if the ring is empty
+ */
+void* ring_try_pop(ring_t* r);
+
+/**
+ * Body of the reader thread: tokenizes stdin into batches of commands
+ * @param arg pipeline
+ */
+void* reader_thread(void* arg);
+
+/**
+ * Body of the writer thread: writes the output chunks on stdout, in the order in which they have been produced
+ * @param arg pipeline
+ */
+void* writer_thread(void* arg);
+
+/**
+ * Runs the editor as a three stage pipeline: reader thread, engine (calling thread) and writer thread
+ * @param e editor
+ */
+void pipeline_run(editor_t* e);
+#endif
+
+/* ------------------------------------------------------------------------------------------ other prototypes ------------------------------------------------------------------------------------------ */
+
+/**
+ * Performs an in-order-tree-walk and prints the text_values of the tree
+ * @param t tree to print
+ * @param x root of the tree
+ * @param start first value to print
+ * @param end last value to print
+ * @param out output in which the lines are printed
+ */
+void in_order_iterative (tree_t * t, node_t* x, int start, int end, output_t* out);
+/* ------------------------------------------------------------------------------------------ functions ------------------------------------------------------------------------------------------ */
+int min(int a, int b)
 {
-    if (node == t->nil)
-        return;
-    else if (node->p != t->nil){
-        if (node == node->p->left)
-            node->p->left = t->nil;
-        else
-            node->p->right = t->nil;
-    } else if (node == t->root){
-        t->root = t-> nil;
+    if (a < b)
+        return a;
+    return b;
+}
+
+node_t* make_tree_node(tree_t* t, int key, char* text_line) //node creation
+{
+    node_t* n;
+
+    if (t->free_nodes){
+        n = t->free_nodes;
+        t->free_nodes = n->right;
+    } else {
+        if (!t->slabs || t->slab_used == NODE_SLAB_SIZE){
+            node_slab_t* slab = (node_slab_t*) malloc(sizeof(node_slab_t));
+
+            slab->next = t->slabs;
+            t->slabs = slab;
+            t->slab_used = 0;
+        }
+        n = &t->slabs->nodes[t->slab_used++];
     }
+    n->col = RED;
+    n->p = t->nil;
+    n->left = t->nil;
+    n->right = t->nil;
+    n->key = key;
+    n->text_line = text_line; //"copies" the text in the text_line field of the node
+    n->bytes = (long) strlen(text_line);
+#ifdef MERKLE_HASH
+    n->line_hash = hash_text(text_line);
+    n->hash = n->line_hash;
+    n->power = HASH_BASE;
+#endif
+#ifdef NGRAM_INDEX
+    ngram_index_add(t->index, n);
+#endif
+
+    return n;
+}
+
+void destroy_tree_node(tree_t* t, node_t* n)
+{
+    n->right = t->free_nodes;
+    t->free_nodes = n;
+}
+
+node_t* make_node_nil() //nil-node creation
+{
+    node_t* nil = (node_t*) malloc(sizeof(node_t));
+    nil->col = BLACK;
+    nil->key = -1;
+    nil->bytes = 0; //never updated: the walks that fix the byte counts stop at nil
+#ifdef MERKLE_HASH
+    nil->hash = 0; //the empty sequence
+    nil->power = 1;
+#endif
+    nil-> p = NULL;
+    nil->left = NULL;
+    nil->right = NULL;
 
-    node_t* left = node->left;
-    if (left != t->nil)
-        left->p = t->nil;
+    return nil;
+}
+
+void tree_create(tree_t* t)
+{
+    t->nil = make_node_nil();
+    t->root = t->nil; //at the beginning root and NIL coincide
+    t->number_of_keys = 0;
+    t->pending_shifts_size = 0;
+    t->shifts_applied = 0;
+    t->slabs = NULL;
+    t->slab_used = 0;
+    t->free_nodes = NULL;
+#ifdef NGRAM_INDEX
+    t->index = ngram_index_create();
+#endif
+}
+
+void tree_destroy(tree_t* t)
+{
+    node_slab_t* next;
 
-    node_t* right = node->right;
-    if (right != t->nil)
-        right->p = t->nil;
-    destroy_tree_node(node);
-    destroy_subtree(t, left);
-    destroy_subtree(t, right);
+    while (t->slabs){
+        next = t->slabs->next;
+        free(t->slabs);
+        t->slabs = next;
+    }
+    t->slab_used = 0;
+    t->free_nodes = NULL;
+    t->root = t->nil;
+    t->number_of_keys = 0;
+    t->pending_shifts_size = 0;
+#ifdef NGRAM_INDEX
+    ngram_index_destroy(t->index);
+    t->index = ngram_index_create();
+#endif
 }
 
 node_t* tree_search(tree_t* t, int key)
@@ -366,18 +1399,20 @@ node_t* tree_search(tree_t* t, int key)
     return NULL;
 }
 
-void tree_insert (tree_t* t, int key, char* text_line, int command_id, stack_t* s)
+static inline void tree_insert_core(tree_t* t, int key, int stored_key, char* text_line, int command_id, stack_t* s, const int record)
 {
     node_t* y;
-    if ((y = tree_search(t,key))){ //checks the node is not already present in the tree, in this case the values of the tree are updated
-        stack_push_values(s, y->key, y->key, command_id, CHANGE, y->text_line); // saves in the undo stack, the already present values of the stack, as a change command
-        y->key = key;
-        y->text_line = text_line;
-        stack_push_values(s, key, key, command_id, DELETE, text_line); //saves in the undo stack as a "delete" command
+
+    if ((y = tree_search(t,stored_key))){ //checks the node is not already present in the tree, in this case the values of the tree are updated
+        if (record)
+            stack_push_values(s, key, key, command_id, CHANGE, y->text_line); // saves in the undo stack, the already present values of the stack, as a change command
+        tree_set_text(t, y, text_line);
+        if (record)
+            stack_push_values(s, key, key, command_id, DELETE, text_line); //saves in the undo stack as a "delete" command
         return;
     }
     else{ //the node is not in the tree: it has to be created and inserted
-        node_t* x = make_tree_node(t,key,text_line);
+        node_t* x = make_tree_node(t,stored_key,text_line);
 
         node_t* pre = t->nil;
         node_t* cur = t->root;
@@ -395,6 +1430,10 @@ void tree_insert (tree_t* t, int key, char* text_line, int command_id, stack_t*
             pre->left = x;
         else
             pre->right = x;
+        tree_add_bytes(t, pre, x->bytes);
+#ifdef MERKLE_HASH
+        tree_fix_hashes(t, pre);
+#endif
 
         x->left = t->nil;
         x->right = t->nil;
@@ -403,9 +1442,15 @@ void tree_insert (tree_t* t, int key, char* text_line, int command_id, stack_t*
 
         t->number_of_keys++; //increases the number of the keys, used to print eventual "."
 
-        stack_push_values(s, x->key, x->key, command_id, DELETE, x->text_line); //the node was not present: only previous deletes are added
+        if (record)
+            stack_push_values(s, key, key, command_id, DELETE, x->text_line); //the node was not present: only previous deletes are added
     }
+}
 
+void tree_insert (tree_t* t, int key, char* text_line, int command_id, stack_t* s)
+{
+    //the history always records addresses, the nodes may still have keys to be shifted
+    tree_insert_core(t, key, tree_stored_key(t, key), text_line, command_id, s, 1);
 }
 
 void tree_insert_from_do(tree_t* t, int key, char* text_line)
@@ -413,40 +1458,23 @@ void tree_insert_from_do(tree_t* t, int key, char* text_line)
     if (key == -1){ //case in which the value to pop from the stack is a "NULL" text or empty
         return;
     }
+    tree_insert_core(t, key, key, text_line, 0, NULL, 0); //the shifts have been applied before the undo/redo
+}
 
-    node_t* y;
-    if ((y = tree_search(t,key))){ //checks the node is not already present in the tree. If yes, the values of the tree are updated
-        y->key = key;
-        y->text_line = text_line;
-        return;
-    }
-    else{ //the node is not already present in the tree. It has to be inserted
-        node_t* x = make_tree_node(t, key, text_line);
-
-        node_t* pre = t->nil;
-        node_t* cur = t->root;
-        while (cur != t->nil){
-            pre = cur;
-            if (x->key < cur->key)
-                cur = cur -> left;
-            else
-                cur = cur -> right;
-        }
-        x->p = pre;
-        if (pre == t->nil) {
-            t->root = x;
-        } else if (x->key < pre->key)
-            pre->left = x;
-        else
-            pre->right = x;
-
-        x->left = t->nil;
-        x->right = t->nil;
-        x->col = RED;
-        tree_insert_fixup(t,x);
-
-        t->number_of_keys++; //increases the number of the keys, used to print eventual "."
-    }
+void tree_set_text(tree_t* t, node_t* x, char* text_line)
+{
+    tree_add_bytes(t, x, (long) strlen(text_line) - (long) strlen(x->text_line));
+#ifdef MERKLE_HASH
+    x->line_hash = hash_text(text_line);
+    tree_fix_hashes(t, x);
+#endif
+#ifdef NGRAM_INDEX
+    ngram_index_remove(t->index, x);
+    x->text_line = text_line;
+    ngram_index_add(t->index, x);
+#else
+    x->text_line = text_line;
+#endif
 }
 
 void tree_insert_fixup(tree_t* t, node_t* z)
@@ -489,17 +1517,22 @@ void tree_insert_fixup(tree_t* t, node_t* z)
     t->root->col = BLACK;
 }
 
-void tree_delete(tree_t* t, node_t* x, int command_id, stack_t* s)
+static inline void tree_delete_core(tree_t* t, node_t* x, int command_id, stack_t* s, const int record)
 {
-
     node_t* subt;
     node_t* to_del;
+    long removed;
+    int key;
 
     if (x == NULL) {
-        stack_push_values(s, -1, -1, command_id, CHANGE, "\0");
+        if (record)
+            stack_push_values(s, -1, -1, command_id, CHANGE, "\0");
         return;
     }
-    stack_push_values(s, x->key, x->key, command_id, CHANGE, x->text_line); //saves on the undo_stack the values that will be cancelled as a CHANGE command
+    if (record){
+        key = tree_line_address(t, x->key);
+        stack_push_values(s, key, key, command_id, CHANGE, x->text_line); //saves on the undo_stack the values that will be cancelled as a CHANGE command
+    }
 
     if ((x->left == t->nil) || (x->right == t->nil)){
         to_del = x;
@@ -523,61 +1556,45 @@ void tree_delete(tree_t* t, node_t* x, int command_id, stack_t* s)
     else{
         to_del->p->right = subt;
     }
+    removed = (long) strlen(to_del->text_line);
+    tree_add_bytes(t, to_del->p, -removed);
 
     if (to_del != x){
         x->key = to_del->key;//if to_del has other fields, they have to be copied
+        tree_add_bytes(t, x, removed - (long) strlen(x->text_line)); //x is an ancestor of to_del, it takes the text of to_del
         x->text_line = to_del->text_line; //"copies" the text_line of to_del to x
+#ifdef MERKLE_HASH
+        x->line_hash = to_del->line_hash;
+#endif
+#ifdef NGRAM_INDEX
+        ngram_index_remove(t->index, x);
+        ngram_index_move(t->index, to_del, x);
+#endif
     }
+#ifdef NGRAM_INDEX
+    else
+        ngram_index_remove(t->index, x);
+#endif
+#ifdef MERKLE_HASH
+    tree_fix_hashes(t, to_del->p); //x, when it takes the text of to_del, is on this path
+#endif
     if (to_del->col == BLACK) {
         tree_delete_fixup(t, subt);
     }
     t->number_of_keys--;
 
-    free(to_del);
+    destroy_tree_node(t, to_del);
 }
 
-void tree_delete_from_do(tree_t* t, node_t* x)
+void tree_delete(tree_t* t, node_t* x, int command_id, stack_t* s)
 {
-    node_t* subt;
-    node_t* to_del;
+    tree_delete_core(t, x, command_id, s, 1);
+}
 
-    if (x == NULL)
-        return;
-
-    if ((x->left == t->nil) || (x->right == t->nil)){
-        to_del = x;
-    }
-    else{
-        to_del = tree_predecessor(t, x);
-    }
-    if (to_del->left != t->nil){
-        subt = to_del->left;
-    }
-    else{
-        subt = to_del->right;
-    }
-    subt->p = to_del->p;
-    if (to_del->p == t->nil){
-        t->root = subt;
-    }
-    else if (to_del == to_del->p->left){
-        to_del->p->left = subt;
-    }
-    else{
-        to_del->p->right = subt;
-    }
-
-    if (to_del != x){
-        x->key = to_del->key;//if to_del has other fields, they have to be copied
-        x->text_line = to_del->text_line; //"copies" the text_live of to_del to x
-    }
-    if (to_del->col == BLACK) {
-        tree_delete_fixup(t, subt);
-    }
-    t->number_of_keys--;
-
-    free(to_del);
-}
+void tree_delete_from_do(tree_t* t, node_t* x)
+{
+    tree_delete_core(t, x, 0, NULL, 0);
+}
 
 void tree_delete_fixup(tree_t* t, node_t* x)
 {
@@ -638,6 +1655,10 @@ void tree_delete_fixup(tree_t* t, node_t* x)
 void left_rotate (tree_t* t, node_t* x)
 {
     node_t* y = x->right; //computes y
+    long x_bytes = x->bytes - y->bytes + y->left->bytes; //x keeps its text, its left subtree and beta
+
+    y->bytes = x->bytes; //y takes the place of x, over the same texts
+    x->bytes = x_bytes;
     x->right = y->left; //moves the subtree of beta
     if (y->left != t->nil) // fixes the referring systems to p of the radix of beta
         y->left->p = x;
@@ -651,11 +1672,19 @@ void left_rotate (tree_t* t, node_t* x)
     }
     y->left = x; //Hooks x to the left of y
     x->p =y;
+#ifdef MERKLE_HASH
+    tree_update_hash(x); //x is now the child of y
+    tree_update_hash(y);
+#endif
 }
 
 void right_rotate (tree_t* t, node_t* x)
 {
     node_t* y = x->left;
+    long x_bytes = x->bytes - y->bytes + y->right->bytes;
+
+    y->bytes = x->bytes;
+    x->bytes = x_bytes;
     x->left = y->right;
     if (y->right != t->nil)
         y->right->p = x;
@@ -669,6 +1698,10 @@ void right_rotate (tree_t* t, node_t* x)
     }
     y->right = x;
     x->p = y;
+#ifdef MERKLE_HASH
+    tree_update_hash(x);
+    tree_update_hash(y);
+#endif
 }
 
 node_t* tree_maximum (tree_t* t, node_t* x)
@@ -699,6 +1732,21 @@ node_t* tree_predecessor(tree_t* t, node_t* x)
     return y; //Time: O(h). h: height of the tree
 }
 
+node_t* tree_lower_bound(tree_t* t, int key)
+{
+    node_t* x = t->root;
+    node_t* y = t->nil;
+
+    while (x != t->nil){
+        if (x->key >= key){
+            y = x;
+            x = x->left;
+        } else
+            x = x->right;
+    }
+    return y; //Time: O(h). h: height of the tree
+}
+
 node_t* tree_successor(tree_t* t, node_t* x)
 {
     if (x->right != t->nil)
@@ -711,30 +1759,732 @@ node_t* tree_successor(tree_t* t, node_t* x)
     return y; //Time: O(h). h: height of the tree
 }
 
-void tree_key_fixup (tree_t* t, node_t *x, int start, int end)
+static inline void tree_key_fixup_core(tree_t* t, int start, int end, const int direction)
+{
+    int shift = direction * (end-start+1);
+    node_t* x;
+
+    //only the nodes from the first key to shift on are visited, in order through the parent pointers
+    for (x = tree_lower_bound(t, direction < 0 ? end : start); x != t->nil; x = tree_successor(t, x))
+        x->key = x->key + shift;
+}
+
+void tree_key_fixup (tree_t* t, int start, int end)
+{
+    tree_key_fixup_core(t, start, end, -1);
+}
+
+void tree_key_fixup_from_do (tree_t* t, int start, int end)
+{
+    tree_key_fixup_core(t, start, end, 1);
+}
+
+void tree_log_key_shift(tree_t* t, int start, int end)
+{
+    if (t->pending_shifts_size == KEY_SHIFT_LOG_SIZE)
+        tree_apply_key_shifts(t);
+    t->pending_shifts[t->pending_shifts_size].start = start;
+    t->pending_shifts[t->pending_shifts_size].width = end-start+1;
+    t->pending_shifts_size++;
+}
+
+int tree_stored_key(tree_t* t, int key)
+{
+    int i;
+
+    for (i = t->pending_shifts_size-1; i >= 0; i--){ //undoes the shifts from the newest to the oldest
+        if (key >= t->pending_shifts[i].start)
+            key = key + t->pending_shifts[i].width;
+    }
+    return key;
+}
+
+int tree_line_address(tree_t* t, int key)
+{
+    int i;
+
+    for (i = 0; i < t->pending_shifts_size; i++){
+        if (key >= t->pending_shifts[i].start + t->pending_shifts[i].width)
+            key = key - t->pending_shifts[i].width;
+    }
+    return key;
+}
+
+void tree_apply_key_shifts(tree_t* t)
+{
+    key_shift_t thresholds[KEY_SHIFT_LOG_SIZE];
+    key_shift_t tmp;
+    node_t* x;
+    int i, j;
+    int cursor = 0;
+    int shift = 0;
+    int size = t->pending_shifts_size;
+
+    if (size == 0)
+        return;
+    t->shifts_applied++;
+
+    //every shift is composed with the older ones: its threshold is expressed as a key stored in the nodes
+    for (i = 0; i < size; i++){
+        thresholds[i].start = t->pending_shifts[i].start + t->pending_shifts[i].width;
+        thresholds[i].width = t->pending_shifts[i].width;
+        for (j = i-1; j >= 0; j--){
+            if (thresholds[i].start >= t->pending_shifts[j].start)
+                thresholds[i].start = thresholds[i].start + t->pending_shifts[j].width;
+        }
+    }
+    for (i = 1; i < size; i++){ //insertion sort: there are only a few thresholds
+        tmp = thresholds[i];
+        for (j = i-1; j >= 0 && thresholds[j].start > tmp.start; j--)
+            thresholds[j+1] = thresholds[j];
+        thresholds[j+1] = tmp;
+    }
+    t->pending_shifts_size = 0;
+
+    //in-order walk from the lowest threshold: the keys are met in increasing order, so the thresholds are crossed one after the other
+    for (x = tree_lower_bound(t, thresholds[0].start); x != t->nil; x = tree_successor(t, x)){
+        while (cursor < size && x->key >= thresholds[cursor].start){
+            shift = shift + thresholds[cursor].width;
+            cursor++;
+        }
+        x->key = x->key - shift;
+    }
+}
+
+void tree_add_bytes(tree_t* t, node_t* x, long bytes)
+{
+    for (; x != t->nil; x = x->p)
+        x->bytes += bytes;
+}
+
+long tree_bytes(tree_t* t)
+{
+    return t->root->bytes;
+}
+
+int tree_offset_line(tree_t* t, long offset)
+{
+    node_t* x = t->root;
+    long length;
+
+    if (offset < 0 || offset >= x->bytes)
+        return 0;
+    while (x != t->nil){
+        length = x->bytes - x->left->bytes - x->right->bytes; //bytes of the text of x
+        if (offset < x->left->bytes)
+            x = x->left;
+        else if (offset < x->left->bytes + length)
+            return tree_line_address(t, x->key);
+        else {
+            offset -= x->left->bytes + length;
+            x = x->right;
+        }
+    }
+    return 0;
+}
+
+int write_lines(int fd, struct iovec* lines, int size) //writev that goes on after the partial writes
+{
+    ssize_t written;
+
+    while (size > 0){
+        written = writev(fd, lines, size);
+        if (written < 0)
+            return 0;
+        while (size > 0 && (size_t) written >= lines->iov_len){
+            written -= (ssize_t) lines->iov_len;
+            lines++;
+            size--;
+        }
+        if (size > 0){
+            lines->iov_base = (char*) lines->iov_base + written;
+            lines->iov_len -= (size_t) written;
+        }
+    }
+    return 1;
+}
+
+long tree_save(tree_t* t, const char* path)
+{
+    struct iovec lines[SAVE_BATCH_SIZE];
+    long size = tree_bytes(t);
+    int n = 0;
+    int fd;
+    node_t* x;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    if (size > 0)
+        posix_fallocate(fd, 0, size); //only a hint: the writes below extend the file anyway
+    for (x = t->root == t->nil ? t->nil : tree_minimum(t, t->root); x != t->nil; x = tree_successor(t, x)){
+        lines[n].iov_base = x->text_line;
+        lines[n].iov_len = strlen(x->text_line);
+        if (lines[n].iov_len > 0 && ++n == SAVE_BATCH_SIZE){
+            if (!write_lines(fd, lines, n))
+                break;
+            n = 0;
+        }
+    }
+    if (x != t->nil || !write_lines(fd, lines, n)){
+        close(fd);
+        return -1;
+    }
+    if (close(fd) == -1)
+        return -1;
+
+    return size;
+}
+
+long tree_batch_walk(tree_t* t, node_t* x, edit_t* edits, int size, int command_id, stack_t* s) //returns the bytes added to the subtree
+{
+    long bytes = 0;
+    int low = 0, high = size, middle;
+
+    if (x == t->nil || size == 0)
+        return 0;
+    while (low < high){ //first change not before x
+        middle = (low + high)/2;
+        if (edits[middle].address < x->key)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    bytes += tree_batch_walk(t, x->left, edits, low, command_id, s);
+    if (low < size && edits[low].address == x->key){
+        bytes += (long) strlen(edits[low].text_line) - (long) strlen(x->text_line);
+        stack_push_values(s, x->key, x->key, command_id, REPLACE, x->text_line);
+#ifdef NGRAM_INDEX
+        ngram_index_remove(t->index, x);
+#endif
+        x->text_line = edits[low].text_line;
+#ifdef NGRAM_INDEX
+        ngram_index_add(t->index, x);
+#endif
+#ifdef MERKLE_HASH
+        x->line_hash = hash_text(x->text_line);
+#endif
+        low++;
+    }
+    bytes += tree_batch_walk(t, x->right, edits + low, size - low, command_id, s);
+    x->bytes += bytes; //the counts are fixed on the way back, once per visited node
+#ifdef MERKLE_HASH
+    tree_update_hash(x);
+#endif
+
+    return bytes;
+}
+
+void tree_batch_change(tree_t* t, edit_t* edits, int size, int command_id, stack_t* s)
+{
+    tree_apply_key_shifts(t); //the keys have to be the addresses
+    tree_batch_walk(t, t->root, edits, size, command_id, s);
+}
+
+#ifdef MERKLE_HASH
+hash_t hash_multiply(hash_t a, hash_t b)
+{
+    unsigned __int128 product = (unsigned __int128) a * b;
+    hash_t h = (hash_t) (product & HASH_MODULUS) + (hash_t) (product >> 61); //2^61 is 1 modulo 2^61-1
+
+    h = (h & HASH_MODULUS) + (h >> 61); //the first fold can leave h up to 2^62-2, this one up to HASH_MODULUS+1
+    return h >= HASH_MODULUS ? h - HASH_MODULUS : h;
+}
+
+hash_t hash_add(hash_t a, hash_t b)
+{
+    hash_t h = a + b;
+
+    return h >= HASH_MODULUS ? h - HASH_MODULUS : h;
+}
+
+hash_t hash_text(const char* text) //FNV-1a, never 0 so that a line always differs from a missing one
+{
+    hash_t h = 14695981039346656037ULL;
+
+    for (; *text; text++){
+        h ^= (unsigned char) *text;
+        h *= 1099511628211ULL;
+    }
+    return h % (HASH_MODULUS - 1) + 1;
+}
+
+void tree_update_hash(node_t* x)
+{
+    x->power = hash_multiply(hash_multiply(x->left->power, HASH_BASE), x->right->power);
+    x->hash = hash_add(hash_multiply(hash_add(hash_multiply(x->left->hash, HASH_BASE), x->line_hash), x->right->power), x->right->hash);
+}
+
+void tree_fix_hashes(tree_t* t, node_t* x)
+{
+    for (; x != t->nil; x = x->p)
+        tree_update_hash(x);
+}
+
+hash_t tree_hash(tree_t* t)
+{
+    return t->root->hash;
+}
+
+void tree_version_take(tree_t* t, version_t* v)
+{
+    node_t* x;
+
+    if (t->number_of_keys + 1 > v->capacity){
+        v->capacity = t->number_of_keys + 1;
+        v->prefix = (hash_t*) realloc(v->prefix, v->capacity * sizeof(hash_t));
+        v->powers = (hash_t*) realloc(v->powers, v->capacity * sizeof(hash_t));
+    }
+    v->prefix[0] = 0;
+    v->powers[0] = 1;
+    v->size = 0;
+    for (x = tree_lower_bound(t, 1); x != t->nil; x = tree_successor(t, x)){
+        v->prefix[v->size+1] = hash_add(hash_multiply(v->prefix[v->size], HASH_BASE), x->line_hash);
+        v->powers[v->size+1] = hash_multiply(v->powers[v->size], HASH_BASE);
+        v->size++;
+    }
+}
+
+hash_t version_range_hash(version_t* v, int start, int end) //hash of the lines from start to end of the version
+{
+    return hash_add(v->prefix[end], HASH_MODULUS - hash_multiply(v->prefix[start-1], v->powers[end-start+1]));
+}
+
+void version_diff_walk(tree_t* t, node_t* x, int lo, int hi, version_t* v, int* lines, int* size) //the keys of the subtree are exactly lo..hi
+{
+    if (x == t->nil)
+        return;
+    if (hi <= v->size && x->hash == version_range_hash(v, lo, hi)) //the whole subtree is equal
+        return;
+    version_diff_walk(t, x->left, lo, x->key-1, v, lines, size);
+    if (x->key > v->size || x->line_hash != version_range_hash(v, x->key, x->key))
+        lines[(*size)++] = x->key;
+    version_diff_walk(t, x->right, x->key+1, hi, v, lines, size);
+}
+
+int tree_version_diff(tree_t* t, version_t* v, int** lines)
+{
+    int size = 0;
+    int i;
+
+    tree_apply_key_shifts(t);
+    *lines = NULL;
+    if (t->number_of_keys == v->size && tree_hash(t) == v->prefix[v->size]) //same document
+        return 0;
+    *lines = (int*) malloc((t->number_of_keys > v->size ? t->number_of_keys : v->size) * sizeof(int));
+    version_diff_walk(t, t->root, 1, t->number_of_keys, v, *lines, &size);
+    for (i = t->number_of_keys+1; i <= v->size; i++) //lines removed since the version
+        (*lines)[size++] = i;
+
+    return size;
+}
+#endif
+
+const char* text_find(const char* text, long length, const char* pattern, long pattern_length)
+{
+    long i = 0;
+
+    if (pattern_length == 0)
+        return text;
+#ifdef __SSE2__
+    if (pattern_length <= length){
+        __m128i first = _mm_set1_epi8(pattern[0]);
+        __m128i last = _mm_set1_epi8(pattern[pattern_length-1]);
+        __m128i block_first, block_last;
+        unsigned int mask;
+
+        //16 candidate positions at a time: the first and the last byte of the pattern have to match before comparing the rest
+        for (; i + pattern_length - 1 + 16 <= length; i += 16){
+            block_first = _mm_loadu_si128((const __m128i*) (text + i));
+            block_last = _mm_loadu_si128((const __m128i*) (text + i + pattern_length - 1));
+            mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+            while (mask){
+                int bit = __builtin_ctz(mask);
+
+                if (memcmp(text + i + bit, pattern, pattern_length) == 0)
+                    return text + i + bit;
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+    for (; i + pattern_length <= length; i++){
+        if (text[i] == pattern[0] && memcmp(text + i, pattern, pattern_length) == 0)
+            return text + i;
+    }
+    return NULL;
+}
+
+void regex_compile(compiled_regex_t* r, const char* re)
+{
+    char* items = (char*) malloc(strlen(re) + 1); //character of every item
+    char* repeated = (char*) malloc(strlen(re) + 1); //true for the items followed by '*'
+    int begin = 0, end = 0, i, c, word;
+    uint64_t bit;
+
+    r->anchored = re[0] == '^';
+    re += r->anchored;
+    r->at_end = 0;
+    for (i = 0; re[i] != '\0'; i += re[i+1] == '*' ? 2 : 1){
+        if (re[i] == '$' && re[i+1] == '\0'){ //elsewhere '$' is an ordinary character
+            r->at_end = 1;
+            break;
+        }
+        items[end] = re[i];
+        repeated[end++] = re[i+1] == '*';
+    }
+    //".*" matches anything: at the beginning it lifts the anchor, at the end the expression can stop before it
+    for (; begin < end && items[begin] == '.' && repeated[begin]; begin++)
+        r->anchored = 0;
+    for (; end > begin && items[end-1] == '.' && repeated[end-1]; end--)
+        r->at_end = 0;
+
+    r->size = end - begin;
+    r->words = r->size/64 + 1; //one bit more than the items
+    r->stars = (uint64_t*) calloc(r->words, sizeof(uint64_t));
+    r->masks = (uint64_t*) calloc(256 * r->words, sizeof(uint64_t));
+    for (i = 0; i < r->size; i++){
+        word = i / 64;
+        bit = 1ULL << (i % 64);
+        if (repeated[begin + i])
+            r->stars[word] |= bit;
+        if (items[begin + i] == '.'){
+            for (c = 0; c < 256; c++)
+                r->masks[c * r->words + word] |= bit;
+        } else
+            r->masks[(unsigned char) items[begin + i] * r->words + word] |= bit;
+    }
+    r->first = !r->anchored && r->size > 0 && items[begin] != '.' && !repeated[begin] ? items[begin] : 0;
+    free(items);
+    free(repeated);
+}
+
+void regex_skip_repeated(const compiled_regex_t* r, uint64_t* states) //adds the states reached by repeating items zero times
+{
+    uint64_t sum, carry = 0, next_carry;
+    int w;
+
+    //adding the states to the repeated items clears the run of repeated items that follows every state and carries past it: the bits flipped
+    //are the run, from the state on, and the item after it
+    for (w = 0; w < r->words; w++){
+        sum = r->stars[w] + (states[w] & r->stars[w]);
+        next_carry = sum < r->stars[w];
+        sum += carry;
+        next_carry |= sum < carry;
+        states[w] |= sum ^ r->stars[w];
+        carry = next_carry;
+    }
+}
+
+int regex_match(const compiled_regex_t* r, const char* text, long length)
+{
+    uint64_t stack_states[2*REGEX_STACK_WORDS];
+    uint64_t* states = stack_states;
+    uint64_t *current, *next, *swap;
+    const uint64_t* masks;
+    uint64_t matched_items, advanced, carry, active;
+    uint64_t match_bit = 1ULL << (r->size % 64);
+    const char* first;
+    long i;
+    int w, matched = 0;
+
+    if (r->words > REGEX_STACK_WORDS)
+        states = (uint64_t*) malloc(2 * r->words * sizeof(uint64_t));
+    current = states;
+    next = states + r->words;
+
+    //bit k of the states is set if the first k items match the text read so far, ending at the current position
+    memset(current, 0, r->words * sizeof(uint64_t));
+    current[0] = 1;
+    for (i = 0; ; i++){
+        regex_skip_repeated(r, current);
+        if ((current[r->size / 64] & match_bit) && (!r->at_end || i == length)){
+            matched = 1;
+            break;
+        }
+        if (i == length)
+            break;
+        if (r->first && r->words == 1 && current[0] == 1){ //only a new match is possible: it starts at the next occurrence of its first character
+            if (!(first = (const char*) memchr(text + i, r->first, length - i)))
+                break;
+            i = first - text;
+        }
+        masks = r->masks + (unsigned char) text[i] * r->words;
+        carry = !r->anchored; //a match can start at every position
+        active = 0;
+        for (w = 0; w < r->words; w++){
+            matched_items = current[w] & masks[w];
+            advanced = matched_items & ~r->stars[w];
+            next[w] = (matched_items & r->stars[w]) | (advanced << 1) | carry;
+            carry = advanced >> 63;
+            active |= next[w];
+        }
+        if (!active)
+            break;
+        swap = current;
+        current = next;
+        next = swap;
+    }
+
+    if (states != stack_states)
+        free(states);
+    return matched;
+}
+
+void regex_free(compiled_regex_t* r)
+{
+    free(r->stars);
+    free(r->masks);
+}
+
+int line_matches(const char* text_line, const char* pattern, long pattern_length, const compiled_regex_t* regex)
+{
+    long length = (long) strlen(text_line);
+
+    if (length > 0 && text_line[length-1] == NEWLINE) //the newline is not part of the text of the line
+        length--;
+    if (regex)
+        return regex_match(regex, text_line, length);
+    return text_find(text_line, length, pattern, pattern_length) != NULL;
+}
+
+void* search_worker(void* arg)
+{
+    search_job_t* job = (search_job_t*) arg;
+    int i;
+
+    for (i = 0; i < job->size; i++)
+        job->matches[i] = (char) line_matches(job->text_lines[i], job->pattern, job->pattern_length, job->regex);
+
+    return NULL;
+}
+
+int compare_int(const void* a, const void* b)
+{
+    return (*(const int*) a > *(const int*) b) - (*(const int*) a < *(const int*) b);
+}
+
+#ifdef NGRAM_INDEX
+ngram_index_t* ngram_index_create()
+{
+    ngram_index_t* index = (ngram_index_t*) calloc(1, sizeof(ngram_index_t));
+
+    return index;
+}
+
+void ngram_index_destroy(ngram_index_t* index)
+{
+    int i;
+
+    for (i = 0; i < (1 << NGRAM_BUCKET_BITS); i++)
+        free(index->buckets[i].ids);
+    free(index->nodes);
+    free(index->id_postings);
+    free(index->free_ids);
+    free(index->dead_ids);
+    free(index);
+}
+
+unsigned int ngram_bucket(const char* trigram)
+{
+    unsigned int ngram = ((unsigned int) (unsigned char) trigram[0] << 16) | ((unsigned int) (unsigned char) trigram[1] << 8) | (unsigned char) trigram[2];
+
+    return (ngram * 2654435761U) >> (32 - NGRAM_BUCKET_BITS);
+}
+
+int ngram_buckets(const char* text, long length, unsigned int* buckets) //distinct buckets of the trigrams of a text, sorted
+{
+    long i;
+    int n = 0;
+    int j, k;
+
+    for (i = 0; i + 3 <= length; i++)
+        buckets[n++] = ngram_bucket(text + i);
+    qsort(buckets, n, sizeof(unsigned int), compare_int);
+    for (j = 0, k = 0; j < n; j++){
+        if (k == 0 || buckets[j] != buckets[k-1])
+            buckets[k++] = buckets[j];
+    }
+    return k;
+}
+
+void int_array_push(int** array, int* size, int* capacity, int value)
+{
+    if (*size == *capacity){
+        *capacity = *capacity ? 2 * *capacity : 4;
+        *array = (int*) realloc(*array, *capacity * sizeof(int));
+    }
+    (*array)[(*size)++] = value;
+}
+
+void ngram_index_compact(ngram_index_t* index) //drops the postings of the texts that left the tree, then their ids can be reused
+{
+    posting_list_t* list;
+    int i, j, k;
+
+    for (i = 0; i < (1 << NGRAM_BUCKET_BITS); i++){
+        list = &index->buckets[i];
+        for (j = 0, k = 0; j < list->size; j++){
+            if (index->nodes[list->ids[j]])
+                list->ids[k++] = list->ids[j];
+        }
+        list->size = k;
+    }
+    for (i = 0; i < index->dead_ids_size; i++)
+        int_array_push(&index->free_ids, &index->free_ids_size, &index->free_ids_capacity, index->dead_ids[i]);
+    index->dead_ids_size = 0;
+    index->dead_postings = 0;
+}
+
+void ngram_index_add(ngram_index_t* index, node_t* x)
+{
+    unsigned int buckets[MAXLINESIZE+1];
+    posting_list_t* list;
+    int id, n, i;
+
+    if (index->free_ids_size > 0)
+        id = index->free_ids[--index->free_ids_size];
+    else {
+        if (index->nodes_size == index->nodes_capacity){
+            index->nodes_capacity = index->nodes_capacity ? 2*index->nodes_capacity : 1024;
+            index->nodes = (node_t**) realloc(index->nodes, index->nodes_capacity * sizeof(node_t*));
+            index->id_postings = (int*) realloc(index->id_postings, index->nodes_capacity * sizeof(int));
+        }
+        id = index->nodes_size++;
+    }
+    n = ngram_buckets(x->text_line, (long) strlen(x->text_line), buckets);
+    for (i = 0; i < n; i++){
+        list = &index->buckets[buckets[i]];
+        int_array_push(&list->ids, &list->size, &list->capacity, id);
+    }
+    index->nodes[id] = x;
+    index->id_postings[id] = n;
+    index->live_postings += n;
+    x->text_id = id;
+}
+
+void ngram_index_remove(ngram_index_t* index, node_t* x)
+{
+    int id = x->text_id;
+
+    index->nodes[id] = NULL; //the postings are dropped lazily
+    index->live_postings -= index->id_postings[id];
+    index->dead_postings += index->id_postings[id];
+    int_array_push(&index->dead_ids, &index->dead_ids_size, &index->dead_ids_capacity, id);
+    if (index->dead_postings > index->live_postings && index->dead_postings > (1 << NGRAM_BUCKET_BITS))
+        ngram_index_compact(index);
+}
+
+void ngram_index_move(ngram_index_t* index, node_t* from, node_t* to)
+{
+    to->text_id = from->text_id;
+    index->nodes[to->text_id] = to;
+}
+
+posting_list_t* ngram_index_candidates(ngram_index_t* index, const char* pattern, long pattern_length)
 {
-    if (x != t->nil){
-        tree_key_fixup(t, x->left, start, end);
-        if (x->key >= end)
-            x->key = x->key - (end-start+1);
-        tree_key_fixup(t, x->right, start, end);
+    posting_list_t* best = NULL;
+    long i;
+
+    for (i = 0; i + 3 <= pattern_length; i++){ //a line containing the pattern contains all its trigrams: the shortest list is enough
+        posting_list_t* list = &index->buckets[ngram_bucket(pattern + i)];
+
+        if (!best || list->size < best->size)
+            best = list;
     }
+    return best;
 }
+#endif
 
-void tree_key_fixup_from_do (tree_t* t, node_t *x, int start, int end)
+int tree_find(tree_t* t, int start, int end, const char* pattern, int is_regex, int** matches)
 {
-    if (x != t->nil){
-        tree_key_fixup_from_do(t, x->left, start, end);
-        if (x->key >= start)
-            x->key = x->key + (end-start+1);
-        tree_key_fixup_from_do(t, x->right, start, end);
+    long pattern_length = (long) strlen(pattern);
+    int size = 0;
+    int count, i, n, threads;
+    char** text_lines;
+    char* found;
+    node_t* x;
+    search_job_t jobs[SEARCH_MAX_THREADS];
+    compiled_regex_t regex;
+    pthread_t workers[SEARCH_MAX_THREADS];
+    int started[SEARCH_MAX_THREADS];
+
+    tree_apply_key_shifts(t);
+    *matches = NULL;
+    if (start < 1)
+        start = 1;
+    if (end > t->number_of_keys)
+        end = t->number_of_keys;
+    if (start > end)
+        return 0;
+    count = end - start + 1;
+
+#ifdef NGRAM_INDEX
+    if (!is_regex && pattern_length >= 3){
+        posting_list_t* candidates = ngram_index_candidates(t->index, pattern, pattern_length);
+
+        if (candidates->size < count){ //only the lines containing the rarest trigram of the pattern are checked
+            *matches = (int*) malloc(candidates->size * sizeof(int));
+            for (i = 0; i < candidates->size; i++){
+                x = t->index->nodes[candidates->ids[i]];
+                if (x && x->key >= start && x->key <= end && line_matches(x->text_line, pattern, pattern_length, NULL))
+                    (*matches)[size++] = x->key;
+            }
+            qsort(*matches, size, sizeof(int), compare_int);
+            return size;
+        }
+    }
+#endif
+
+    text_lines = (char**) malloc(count * sizeof(char*));
+    found = (char*) malloc(count);
+    for (i = 0, x = tree_search(t, start); i < count; i++, x = tree_successor(t, x))
+        text_lines[i] = x->text_line;
+
+    if (is_regex) //compiled once, shared by all the threads
+        regex_compile(&regex, pattern);
+    threads = 1;
+    if (count >= SEARCH_PARALLEL_LINES){
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        threads = threads < 1 ? 1 : (threads > SEARCH_MAX_THREADS ? SEARCH_MAX_THREADS : threads);
+    }
+    for (i = 0, n = 0; i < threads; i++){ //every thread checks a contiguous slice of the lines
+        jobs[i].text_lines = text_lines + n;
+        jobs[i].matches = found + n;
+        jobs[i].size = count/threads + (i < count%threads);
+        jobs[i].pattern = pattern;
+        jobs[i].pattern_length = pattern_length;
+        jobs[i].regex = is_regex ? &regex : NULL;
+        n += jobs[i].size;
+    }
+    for (i = 1; i < threads; i++)
+        started[i] = pthread_create(&workers[i], NULL, search_worker, &jobs[i]) == 0;
+    search_worker(&jobs[0]);
+    for (i = 1; i < threads; i++){
+        if (started[i])
+            pthread_join(workers[i], NULL);
+        else //no thread available: the slice is checked by the calling thread
+            search_worker(&jobs[i]);
     }
+
+    *matches = (int*) malloc(count * sizeof(int));
+    for (i = 0; i < count; i++){
+        if (found[i])
+            (*matches)[size++] = start + i;
+    }
+    free(text_lines);
+    free(found);
+    if (is_regex)
+        regex_free(&regex);
+
+    return size;
 }
 
 void stack_create(stack_t* s)
 {
     s->size = 0;
     s->top = NULL;
+    s->bytes = 0;
 }
 
 int is_empty (stack_t* s)
@@ -751,6 +2501,7 @@ list_of_commands_t* pop (stack_t** s)
 
     old_top = (*s)->top;
     (*s)->top = (*s)->top->next;
+    (*s)->bytes -= stack_node_bytes(old_top);
 
     return old_top;
 }
@@ -763,6 +2514,7 @@ void make_empty_stack(stack_t* s)
         free(to_del);
     }
     s->size = 0;
+    s->bytes = 0;
 }
 
 void stack_push_values (stack_t* s, int begin, int end, int command_id, char command, char* text_line)
@@ -775,9 +2527,12 @@ void stack_push_values (stack_t* s, int begin, int end, int command_id, char com
         new_node->command_id = command_id;
         new_node->command = command;
         new_node->text_line = text_line;
+        new_node->owned = (command == CHANGE && begin != -1) || command == REPLACE; //the text of a change has been removed from the tree
+        new_node->length = new_node->owned ? (short) strlen(text_line) : 0;
 
         new_node->next = s->top;
         s->top = new_node;
+        s->bytes += stack_node_bytes(new_node);
     } else
         printf("Memory allocation error!\n");
 
@@ -787,23 +2542,535 @@ void stack_push_node(stack_t* s, list_of_commands_t* node)
 {
     node->next = s->top;
     s->top = node;
+    s->bytes += stack_node_bytes(node);
 }
 
-void undo_command (tree_t* t, stack_t* undo_stack, stack_t* redo_stack)
+long stack_node_bytes(list_of_commands_t* node)
 {
-    list_of_commands_t* node_to_redo;
+    if (node->owned)
+        return (long) sizeof(list_of_commands_t) + node->length + 1;
+    return (long) sizeof(list_of_commands_t);
+}
 
-    if (undo_stack->top->command == CHANGE){
-        tree_insert_from_do(t, undo_stack->top->begin, undo_stack->top->text_line);
+void history_spill_create(history_spill_t* h, long budget, long hot_budget)
+{
+    h->fd = -1;
+    h->budget = budget;
+    h->hot_budget = budget > 0 && hot_budget > budget/2 ? budget/2 : hot_budget; //the hot history has to leave room for the compressed one
+    h->cold_bytes = 0;
+    h->file_size = 0;
+    h->segments = NULL;
+    h->segments_size = 0;
+    h->segments_capacity = 0;
+    h->segments_in_file = 0;
+    h->chain_fd = -1;
+    h->chain_file_size = 0;
+    h->chains = NULL;
+    h->chains_size = 0;
+    h->chains_capacity = 0;
+    h->free_chain = -1;
+    h->undo_kept = 0;
+    h->redo_kept = 0;
+    memset(&h->stats, 0, sizeof(history_stats_t));
+}
+
+long lz_compress_bound(long size)
+{
+    return size + size/255 + 16;
+}
+
+long lz_put_length(char* dst, long length) //lengths that do not fit in the 4 bits of the token continue in bytes of 255
+{
+    long n = 0;
+
+    while (length >= 255){
+        dst[n++] = (char) 255;
+        length -= 255;
+    }
+    dst[n++] = (char) length;
+    return n;
+}
+
+long lz_put_sequence(char* dst, const char* literals, long literal_length, long offset, long match_length)
+{
+    long n = 1;
+    unsigned char token;
+
+    token = (unsigned char) ((literal_length < 15 ? literal_length : 15) << 4);
+    if (match_length)
+        token |= (unsigned char) (match_length - LZ_MIN_MATCH < 15 ? match_length - LZ_MIN_MATCH : 15);
+    dst[0] = (char) token;
+    if (literal_length >= 15)
+        n += lz_put_length(dst + n, literal_length - 15);
+    memcpy(dst + n, literals, literal_length);
+    n += literal_length;
+    if (match_length){
+        dst[n++] = (char) (offset & 0xff);
+        dst[n++] = (char) (offset >> 8);
+        if (match_length - LZ_MIN_MATCH >= 15)
+            n += lz_put_length(dst + n, match_length - LZ_MIN_MATCH - 15);
+    }
+    return n;
+}
+
+long lz_compress(const char* src, long size, char* dst)
+{
+    long* table = (long*) malloc(sizeof(long) << LZ_HASH_BITS);
+    const unsigned char* in = (const unsigned char*) src;
+    long pos = 0;
+    long anchor = 0;
+    long n = 0;
+    long ref, length;
+    unsigned int sequence, hash;
+
+    memset(table, -1, sizeof(long) << LZ_HASH_BITS);
+    while (pos + LZ_MIN_MATCH <= size){
+        memcpy(&sequence, in + pos, sizeof(unsigned int));
+        hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+        ref = table[hash];
+        table[hash] = pos;
+        if (ref >= 0 && pos - ref <= LZ_MAX_OFFSET && memcmp(in + ref, in + pos, LZ_MIN_MATCH) == 0){
+            length = LZ_MIN_MATCH;
+            while (pos + length < size && in[ref + length] == in[pos + length])
+                length++;
+            n += lz_put_sequence(dst + n, src + anchor, pos - anchor, pos - ref, length);
+            pos += length;
+            anchor = pos;
+        } else
+            pos++;
+    }
+    n += lz_put_sequence(dst + n, src + anchor, size - anchor, 0, 0); //the last literals have no match
+    free(table);
+
+    return n;
+}
+
+long lz_get_length(const unsigned char* src, long* ip, long length)
+{
+    unsigned char c;
+
+    if (length == 15){
+        do {
+            c = src[(*ip)++];
+            length += c;
+        } while (c == 255);
+    }
+    return length;
+}
+
+long lz_decompress(const char* src, long size, char* dst)
+{
+    const unsigned char* in = (const unsigned char*) src;
+    long ip = 0;
+    long op = 0;
+    long length, offset;
+    unsigned char token;
+
+    while (ip < size){
+        token = in[ip++];
+        length = lz_get_length(in, &ip, token >> 4);
+        memcpy(dst + op, src + ip, length);
+        ip += length;
+        op += length;
+        if (ip >= size) //the last sequence has only literals
+            break;
+        offset = in[ip] | (in[ip+1] << 8);
+        ip += 2;
+        length = lz_get_length(in, &ip, token & 15) + LZ_MIN_MATCH;
+        while (length--){ //byte by byte: the match can overlap the bytes it is producing
+            dst[op] = dst[op - offset];
+            op++;
+        }
+    }
+    return op;
+}
+
+int history_open_file(void) //creates a spill file in $TMPDIR (/tmp if it is not set), the file disappears as soon as the editor exits
+{
+    const char* dir = getenv("TMPDIR");
+    char* file_name;
+    int fd;
+
+    if (!dir || !*dir)
+        dir = "/tmp";
+    file_name = (char*) malloc(strlen(dir) + sizeof("/history_spill_XXXXXX"));
+    sprintf(file_name, "%s/history_spill_XXXXXX", dir);
+    fd = mkstemp(file_name);
+    if (fd != -1)
+        unlink(file_name);
+    free(file_name);
+
+    return fd;
+}
+
+void history_write_segment(history_spill_t* h) //moves the oldest segment kept in memory in the spill file
+{
+    spill_segment_t* segment = &h->segments[h->segments_in_file];
+
+    if (h->fd == -1){
+        h->fd = history_open_file();
+        if (h->fd == -1){
+            h->budget = 0; //no place for the spill: the history stays in memory
+            return;
+        }
+    }
+    if (pwrite(h->fd, segment->data, segment->size, h->file_size) != segment->size){
+        h->budget = 0;
+        return;
+    }
+    segment->offset = h->file_size;
+    h->file_size += segment->size;
+    free(segment->data);
+    segment->data = NULL;
+    h->cold_bytes -= segment->size;
+    h->segments_in_file++;
+    h->stats.segments_written++;
+}
+
+void history_write_chain(history_spill_t* h, spill_segment_t* segment) //moves a redo segment in its spill file
+{
+    if (h->chain_fd == -1){
+        h->chain_fd = history_open_file();
+        if (h->chain_fd == -1){
+            h->budget = 0;
+            return;
+        }
+    }
+    if (pwrite(h->chain_fd, segment->data, segment->size, h->chain_file_size) != segment->size){
+        h->budget = 0;
+        return;
+    }
+    segment->offset = h->chain_file_size;
+    h->chain_file_size += segment->size;
+    free(segment->data);
+    segment->data = NULL;
+    h->cold_bytes -= segment->size;
+    h->stats.segments_written++;
+}
+
+char* history_serialize(list_of_commands_t* first, list_of_commands_t* stop, int redo, long* size) //serializes the commands from first to stop excluded, from the newest to the oldest like they are in the stack
+{
+    list_of_commands_t* x;
+    char* buffer;
+    char* b;
+    short length;
+
+    *size = 0;
+    for (x = first; x != stop; x = x->next)
+        *size += 3*sizeof(int) + sizeof(char) + sizeof(short) + (redo && x->command == CHANGE ? 0 : strlen(x->text_line));
+    buffer = (char*) malloc(*size);
+    b = buffer;
+    for (x = first; x != stop; x = x->next){
+        length = redo && x->command == CHANGE ? 0 : (short) strlen(x->text_line); //the text of a change to redo is in the tree
+
+        memcpy(b, &x->begin, sizeof(int)); b += sizeof(int);
+        memcpy(b, &x->end, sizeof(int)); b += sizeof(int);
+        memcpy(b, &x->command_id, sizeof(int)); b += sizeof(int);
+        *b = x->command; b += sizeof(char);
+        memcpy(b, &length, sizeof(short)); b += sizeof(short);
+        memcpy(b, x->text_line, length); b += length;
+    }
+
+    return buffer;
+}
+
+void history_compress(history_spill_t* h, spill_segment_t* segment, char* buffer, long size) //compresses a serialized buffer in a segment kept in memory, the buffer is freed
+{
+    segment->data = (char*) malloc(lz_compress_bound(size));
+    segment->size = lz_compress(buffer, size, segment->data);
+    segment->data = (char*) realloc(segment->data, segment->size);
+    segment->raw_size = size;
+    segment->offset = -1;
+    free(buffer);
+    h->cold_bytes += segment->size;
+    h->stats.segments_compressed++;
+    h->stats.raw_bytes += size;
+    h->stats.compressed_bytes += segment->size;
+}
+
+list_of_commands_t* history_decompress(history_spill_t* h, spill_segment_t* segment, int fd, list_of_commands_t** last, long* bytes) //reads back the commands of a segment, the segment data is freed
+{
+    list_of_commands_t* first = NULL;
+    list_of_commands_t* x;
+    char* compressed;
+    char* buffer;
+    char* b;
+    short length;
+
+    if (segment->data){
+        compressed = segment->data;
+        h->cold_bytes -= segment->size;
+    } else {
+        compressed = (char*) malloc(segment->size);
+        if (!compressed || pread(fd, compressed, segment->size, segment->offset) != segment->size){
+            fprintf(stderr, "Cannot read the spilled history!\n");
+            exit(1);
+        }
+    }
+    segment->data = NULL;
+    buffer = (char*) malloc(segment->raw_size);
+    lz_decompress(compressed, segment->size, buffer);
+    free(compressed);
+
+    *last = NULL;
+    for (b = buffer; b < buffer + segment->raw_size; ){
+        x = (list_of_commands_t*) malloc(sizeof(list_of_commands_t));
+        memcpy(&x->begin, b, sizeof(int)); b += sizeof(int);
+        memcpy(&x->end, b, sizeof(int)); b += sizeof(int);
+        memcpy(&x->command_id, b, sizeof(int)); b += sizeof(int);
+        x->command = *b; b += sizeof(char);
+        memcpy(&length, b, sizeof(short)); b += sizeof(short);
+        if (length > 0){ //the text read back is a private copy of the command
+            x->text_line = (char*) malloc(length+1);
+            memcpy(x->text_line, b, length);
+            x->text_line[length] = '\0';
+            b += length;
+        } else
+            x->text_line = "\0";
+        x->owned = length > 0;
+        x->length = length;
+        x->next = NULL;
+        if (*last)
+            (*last)->next = x;
+        else
+            first = x;
+        *last = x;
+        *bytes += stack_node_bytes(x);
+    }
+    free(buffer);
+
+    return first;
+}
+
+void history_count_restore(history_spill_t* h, struct timespec* begin) //adds the time spent reading back a segment to the stats
+{
+    struct timespec end;
+    long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (end.tv_sec - begin->tv_sec) * 1000000000L + (end.tv_nsec - begin->tv_nsec);
+    h->stats.segments_restored++;
+    h->stats.restore_ns += ns;
+    if (ns > h->stats.max_restore_ns)
+        h->stats.max_restore_ns = ns;
+}
+
+void history_spill(history_spill_t* h, stack_t* undo_stack, stack_t* redo_stack)
+{
+    list_of_commands_t* last_kept;
+    list_of_commands_t* x;
+    list_of_commands_t* next;
+    spill_segment_t* segment;
+    long kept_bytes;
+    long size;
+    char* buffer;
+    stack_t* s = undo_stack;
+
+    if (s->bytes < h->undo_kept)
+        h->undo_kept = s->bytes;
+    if (h->hot_budget > 0 && s->bytes > h->hot_budget && s->bytes - h->undo_kept > h->hot_budget/2 && s->top){
+        //keeps the newest levels up to half of the hot budget, always ending with a whole level
+        last_kept = s->top;
+        kept_bytes = stack_node_bytes(last_kept);
+        while (last_kept->next && (kept_bytes <= h->hot_budget/2 || last_kept->next->command_id == last_kept->command_id)){
+            last_kept = last_kept->next;
+            kept_bytes += stack_node_bytes(last_kept);
+        }
+        if (last_kept->next){
+            if (h->segments_size == h->segments_capacity){
+                h->segments_capacity = h->segments_capacity ? 2*h->segments_capacity : 16;
+                h->segments = (spill_segment_t*) realloc(h->segments, h->segments_capacity * sizeof(spill_segment_t));
+            }
+            segment = &h->segments[h->segments_size++];
+            buffer = history_serialize(last_kept->next, NULL, 0, &size);
+            history_compress(h, segment, buffer, size);
+
+            //the texts are freed only when all of them have been serialized, a change and the command that added the same text may be in the same segment
+            for (x = last_kept->next; x; x = next){
+                next = x->next;
+                if (x->owned)
+                    free(x->text_line);
+                free(x);
+            }
+            last_kept->next = NULL;
+            s->bytes = kept_bytes;
+        }
+        h->undo_kept = s->bytes; //a level bigger than the hot budget is not walked again at every command
+    }
+    if (redo_stack->bytes < h->redo_kept)
+        h->redo_kept = redo_stack->bytes;
+    if (h->hot_budget > 0 && redo_stack->bytes > h->hot_budget/2 && redo_stack->bytes - h->redo_kept > h->hot_budget/4){
+        history_spill_chain(h, redo_stack->top, &redo_stack->bytes, h->hot_budget/4);
+        h->redo_kept = redo_stack->bytes;
+    }
+
+    while (h->budget > 0 && undo_stack->bytes + redo_stack->bytes + h->cold_bytes > h->budget && h->segments_in_file < h->segments_size)
+        history_write_segment(h);
+}
+
+void history_spill_chain(history_spill_t* h, list_of_commands_t* top, long* bytes, long keep)
+{
+    list_of_commands_t* last_kept;
+    list_of_commands_t* stop;
+    list_of_commands_t* x;
+    list_of_commands_t* next;
+    spill_segment_t* segment;
+    long kept_bytes;
+    long size;
+    char* buffer;
+    int slot;
+    int command_id;
+
+    if (h->hot_budget <= 0 || !top)
+        return;
+    last_kept = top;
+    kept_bytes = stack_node_bytes(last_kept);
+    while (last_kept->next && last_kept->next->command != SPILLED && (kept_bytes <= keep || last_kept->next->command_id == last_kept->command_id)){
+        last_kept = last_kept->next;
+        kept_bytes += stack_node_bytes(last_kept);
+    }
+    if (!last_kept->next || last_kept->next->command == SPILLED)
+        return;
+    for (stop = last_kept->next; stop && stop->command != SPILLED; stop = stop->next) //the tail already compressed stays where it is
+        ;
+
+    if (h->free_chain != -1){
+        slot = h->free_chain;
+        h->free_chain = (int) h->chains[slot].offset;
+    } else {
+        if (h->chains_size == h->chains_capacity){
+            h->chains_capacity = h->chains_capacity ? 2*h->chains_capacity : 16;
+            h->chains = (spill_segment_t*) realloc(h->chains, h->chains_capacity * sizeof(spill_segment_t));
+        }
+        slot = h->chains_size++;
+    }
+    segment = &h->chains[slot];
+    buffer = history_serialize(last_kept->next, stop, 1, &size);
+    history_compress(h, segment, buffer, size);
+
+    command_id = last_kept->next->command_id;
+    //the deletes and the replaces to redo hold the only pointer to a text out of the tree
+    for (x = last_kept->next; x != stop; x = next){
+        next = x->next;
+        *bytes -= stack_node_bytes(x);
+        if (x->command != CHANGE && x->text_line[0] != '\0')
+            free(x->text_line);
+        free(x);
+    }
+    x = (list_of_commands_t*) malloc(sizeof(list_of_commands_t));
+    x->begin = slot;
+    x->end = 0;
+    x->command_id = command_id; //the jumps look for the level at the top of the redo stack
+    x->command = SPILLED;
+    x->owned = 0;
+    x->length = 0;
+    x->text_line = "\0";
+    x->next = stop;
+    last_kept->next = x;
+    *bytes += stack_node_bytes(x);
+
+    if (h->budget > 0)
+        history_write_chain(h, segment);
+}
+
+void history_spill_destroy(history_spill_t* h)
+{
+    int i;
+
+    for (i = h->segments_in_file; i < h->segments_size; i++)
+        free(h->segments[i].data);
+    free(h->segments);
+    for (i = 0; i < h->chains_size; i++)
+        free(h->chains[i].data); //NULL for the free slots and for the segments in the file
+    free(h->chains);
+    if (h->fd != -1)
+        close(h->fd);
+    if (h->chain_fd != -1)
+        close(h->chain_fd);
+    h->fd = -1;
+    h->chain_fd = -1;
+    h->segments = NULL;
+    h->segments_size = 0;
+    h->segments_capacity = 0;
+    h->segments_in_file = 0;
+    h->chains = NULL;
+    h->chains_size = 0;
+    h->chains_capacity = 0;
+    h->free_chain = -1;
+    h->cold_bytes = 0;
+    h->file_size = 0;
+    h->chain_file_size = 0;
+}
+
+void history_page_in(history_spill_t* h, stack_t* s)
+{
+    spill_segment_t* segment;
+    list_of_commands_t* last;
+    struct timespec begin;
+
+    if (s->top || h->segments_size == 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    segment = &h->segments[h->segments_size-1];
+    if (!segment->data){
+        h->file_size = segment->offset;
+        h->segments_in_file--;
+    }
+    s->top = history_decompress(h, segment, h->fd, &last, &s->bytes);
+    h->segments_size--;
+    history_count_restore(h, &begin);
+}
+
+void history_page_in_chain(history_spill_t* h, stack_t* s)
+{
+    list_of_commands_t* spilled = s->top;
+    list_of_commands_t* last;
+    struct timespec begin;
+    int slot;
+
+    if (!spilled || spilled->command != SPILLED)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    slot = spilled->begin;
+    s->top = history_decompress(h, &h->chains[slot], h->chain_fd, &last, &s->bytes);
+    last->next = spilled->next;
+    s->bytes -= stack_node_bytes(spilled);
+    free(spilled);
+    h->chains[slot].offset = h->free_chain;
+    h->free_chain = slot;
+    history_count_restore(h, &begin);
+}
+
+void undo_command (tree_t* t, stack_t* undo_stack, stack_t* redo_stack)
+{
+    list_of_commands_t* node_to_redo;
+
+    if (undo_stack->top->command == CHANGE){
+        tree_insert_from_do(t, undo_stack->top->begin, undo_stack->top->text_line);
         node_to_redo = pop(&undo_stack);
         stack_push_node(redo_stack, node_to_redo);
     } else if (undo_stack->top->command == DELETE){
-        tree_delete_from_do(t, tree_search(t,undo_stack->top->begin));
+        node_t* x = tree_search(t, undo_stack->top->begin);
+
         node_to_redo = pop(&undo_stack);
+        if (x && x->text_line != node_to_redo->text_line){ //a command read back from the spill has its own copy: it takes the text that leaves the tree
+            if (node_to_redo->owned){
+                free(node_to_redo->text_line);
+                node_to_redo->length = (short) strlen(x->text_line);
+            }
+            node_to_redo->text_line = x->text_line;
+        }
+        tree_delete_from_do(t, x);
         stack_push_node(redo_stack, node_to_redo);
     } else if (undo_stack->top->command == FIX_VALUES){
-        tree_key_fixup_from_do(t, t->root, undo_stack->top->begin, undo_stack->top->end);
+        tree_key_fixup_from_do(t, undo_stack->top->begin, undo_stack->top->end);
+        node_to_redo = pop(&undo_stack);
+        stack_push_node(redo_stack, node_to_redo);
+    } else if (undo_stack->top->command == REPLACE){
         node_to_redo = pop(&undo_stack);
+        history_swap_text(t, node_to_redo);
         stack_push_node(redo_stack, node_to_redo);
     }
 }
@@ -813,202 +3080,1332 @@ void redo_command (tree_t* t, stack_t* undo_stack, stack_t* redo_stack) //N.B. T
     list_of_commands_t* node_to_undo;
 
     if (redo_stack->top->command == CHANGE){
-        tree_delete_from_do(t, tree_search(t, redo_stack->top->begin));
+        node_t* x = tree_search(t, redo_stack->top->begin);
+
         node_to_undo = pop(&redo_stack);
+        if (x){ //the command takes the text that leaves the tree: after a branch switch it may be a copy read back from the spill
+            node_to_undo->text_line = x->text_line;
+            node_to_undo->length = (short) strlen(x->text_line);
+            node_to_undo->owned = 1; //a change read back from a redo segment had no text
+        }
+        tree_delete_from_do(t, x);
         stack_push_node(undo_stack, node_to_undo);
     } else if (redo_stack->top->command == DELETE){
         tree_insert_from_do(t, redo_stack->top->begin, redo_stack->top->text_line);
         node_to_undo = pop(&redo_stack);
+        node_to_undo->owned = 0; //the text is in the tree again
         stack_push_node(undo_stack, node_to_undo);
     } else if (redo_stack->top->command == FIX_VALUES){
-        tree_key_fixup(t,t->root,redo_stack->top->begin, redo_stack->top->end);
+        tree_key_fixup(t, redo_stack->top->begin, redo_stack->top->end);
+        node_to_undo = pop(&redo_stack);
+        stack_push_node(undo_stack, node_to_undo);
+    } else if (redo_stack->top->command == REPLACE){
         node_to_undo = pop(&redo_stack);
+        history_swap_text(t, node_to_undo);
         stack_push_node(undo_stack, node_to_undo);
     }
 }
 
+void history_swap_text(tree_t* t, list_of_commands_t* replace)
+{
+    node_t* x = tree_search(t, replace->begin);
+    char* text_line = x->text_line;
 
-int main () {
+    tree_set_text(t, x, replace->text_line);
+    replace->text_line = text_line; //the command keeps the text that left the tree
+    replace->length = (short) strlen(text_line);
+}
 
-    int start, end, i;
-    int line_number;
-    int tree_number_of_keys;
-    int command;
-    int command_id = 1;
-    int starting_command_id;
 
-    int start_do; //variable used to implement an "algebraic sum" between undo-s and redo-s in order to speed up the undo/redo commands
-    int temporary_undo_stack_size;
-    int temporary_redo_stack_size;
-    int a;
+command_batch_t* batch_create()
+{
+    command_batch_t* b = (command_batch_t*) malloc(sizeof(command_batch_t));
 
-    char text[MAXLINESIZE+1];
-    char * effective_string;
+    b->size = 0;
+    b->text_lines_size = 0;
+    b->text_lines_capacity = COMMAND_BATCH_LINES;
+    b->text_lines = (char**) malloc(b->text_lines_capacity * sizeof(char*));
+    b->text_addresses = (int*) malloc(b->text_lines_capacity * sizeof(int));
 
-    tree_t* t = (tree_t*)malloc(sizeof(tree_t));
-    stack_t* undo_stack = (stack_t*)malloc(sizeof(stack_t));
-    stack_t* redo_stack = (stack_t*)malloc(sizeof(stack_t));
+    return b;
+}
+
+void batch_clear(command_batch_t* b)
+{
+    b->size = 0;
+    b->text_lines_size = 0;
+}
 
-    tree_create(t);
-    stack_create(undo_stack);
-    stack_create(redo_stack);
+void batch_destroy(command_batch_t* b)
+{
+    free(b->text_lines);
+    free(b->text_addresses);
+    free(b);
+}
+
+int read_number(int* value) //reads an integer like scanf("%d") does: leading blanks are skipped, the value is left untouched if there is no number
+{
+    int c;
+    int sign = 1;
+    int n = 0;
 
     do {
-        scanf("%d,%d", &start, &end);
+        c = getchar_unlocked();
+    } while (c == ' ' || c == NEWLINE || c == '\t' || c == '\r');
+    if (c == '-' || c == '+'){
+        if (c == '-')
+            sign = -1;
+        c = getchar_unlocked();
+    }
+    if (c < '0' || c > '9'){
+        ungetc(c, stdin);
+        return 0;
+    }
+    while (c >= '0' && c <= '9'){
+        n = n*10 + (c - '0');
+        c = getchar_unlocked();
+    }
+    ungetc(c, stdin);
+    *value = sign*n;
+
+    return 1;
+}
+
+void read_text_line(command_batch_t* b)
+{
+    char text[MAXLINESIZE+1];
+
+    if (b->text_lines_size == b->text_lines_capacity){
+        b->text_lines_capacity *= 2;
+        b->text_lines = (char**) realloc(b->text_lines, b->text_lines_capacity * sizeof(char*));
+        b->text_addresses = (int*) realloc(b->text_addresses, b->text_lines_capacity * sizeof(int));
+    }
+    if (!fgets(text, MAXLINESIZE+1, stdin))
+        text[0] = '\0';
+    b->text_lines[b->text_lines_size] = malloc(strlen(text)+1);
+    strcpy(b->text_lines[b->text_lines_size], text);
+    b->text_lines_size++;
+}
+
+char read_command(reader_t* r, command_batch_t* b)
+{
+    command_t* cmd = &b->commands[b->size++];
+    int command;
+    int line_number;
+    int address = 0;
+    int separator;
+
+    if (read_number(&r->start)){
         command = getchar_unlocked();
+        if (command == ',')
+            read_number(&r->end);
+        else
+            ungetc(command, stdin);
+    }
+    command = getchar_unlocked();
+    if (command == EOF) //the input ended without a quit command
+        command = QUIT;
 
-        //analysis of the various commands
-        if (command == UNDO){
-            getchar_unlocked();
-            temporary_undo_stack_size = undo_stack->size;
-            temporary_redo_stack_size = redo_stack->size;
-            a = min(start, temporary_undo_stack_size);
-            start_do = a;  //undo-s are counted as positive
-            temporary_undo_stack_size = temporary_undo_stack_size - a;
-            temporary_redo_stack_size = temporary_redo_stack_size + a;
-            do{
-                scanf("%d,%d", &start, &end);
-                command = getchar_unlocked();
-                if (command == UNDO){
-                    a = min(start, temporary_undo_stack_size);
-                    start_do = start_do+a;  //undo-s are counted as positive
-                    temporary_undo_stack_size = temporary_undo_stack_size - a;
-                    temporary_redo_stack_size = temporary_redo_stack_size + a;
-                }
-                else if (command == REDO){
-                    a = min(start, temporary_redo_stack_size);
-                    start_do = start_do-a;
-                    temporary_redo_stack_size = temporary_redo_stack_size - a;
-                    temporary_undo_stack_size = temporary_undo_stack_size + a;
-                }
-            } while (command == UNDO || command == REDO);
-            if (start_do > 0){
-                for (i = 0; i < start_do; i++){
-                    starting_command_id = undo_stack->top->command_id;
-                    while (undo_stack->top != NULL && (undo_stack->top->command_id == starting_command_id))
-                        undo_command(t,undo_stack,redo_stack);
-                    undo_stack->size--;
-                    redo_stack->size++;
-                }
-            } else if (start_do < 0 ){
-                for (i = 0; i < (-start_do); i++){
-                    starting_command_id = redo_stack->top->command_id;
-                    while (redo_stack->top != NULL && (redo_stack->top->command_id == starting_command_id))
-                        redo_command(t, undo_stack,redo_stack);
-                    redo_stack->size--;
-                    undo_stack->size++;
-                }
-            }
+    cmd->start = r->start;
+    cmd->end = r->end;
+    cmd->command = (char) command;
+    cmd->first_line = b->text_lines_size;
+
+    if (command == CHANGE){
+        getchar_unlocked();
+        for (line_number = r->start; line_number <= r->end; line_number++)
+            read_text_line(b);
+    } else if (command == BATCH_CHANGE){ //the changes follow, one per line: the address, a blank and the text
+        getchar_unlocked();
+        for (line_number = 0; line_number < r->start; line_number++){
+            read_number(&address);
+            separator = getchar_unlocked();
+            if (separator != ' ')
+                ungetc(separator, stdin);
+            read_text_line(b);
+            b->text_addresses[b->text_lines_size-1] = address;
         }
-        else if (command == REDO){
-            getchar_unlocked();
-
-            //undo-s are counted as positive, redo-s as negative
-            temporary_undo_stack_size = undo_stack->size;
-            temporary_redo_stack_size = redo_stack->size;
-            a = min(start, temporary_redo_stack_size);
-            start_do = - a;
-            temporary_redo_stack_size = temporary_redo_stack_size - a;
-            temporary_undo_stack_size = temporary_undo_stack_size + a;
-            do{
-                scanf("%d,%d", &start, &end);
-                command = getchar_unlocked();
-                if (command == UNDO){
-                    a = min(start, temporary_undo_stack_size);
-                    start_do = start_do + a;  //undo-s are counted as positive
-                    temporary_undo_stack_size = temporary_undo_stack_size - a;
-                    temporary_redo_stack_size = temporary_redo_stack_size + a;
-                }
-                else if (command == REDO) {
-                    a = min(start, temporary_redo_stack_size);
-                    start_do = start_do-a;
-                    temporary_redo_stack_size = temporary_redo_stack_size - a;
-                    temporary_undo_stack_size = temporary_undo_stack_size + a;
-                }
-            } while (command == UNDO || command == REDO);
-            if (start_do > 0){
-                for (i = 0; i < start_do; i++){
-                    starting_command_id = undo_stack->top->command_id;
-                    while (undo_stack->top != NULL && (undo_stack->top->command_id == starting_command_id)) {
-                        undo_command(t,undo_stack,redo_stack);
-                    }
-                    undo_stack->size--;
-                    redo_stack->size++;
-                }
-            } else if (start_do < 0 ){
-                for (i = 0; i < (-start_do); i++){
-                    starting_command_id = redo_stack->top->command_id;
-                    while (redo_stack->top != NULL && (redo_stack->top->command_id == starting_command_id))
-                        redo_command(t, undo_stack,redo_stack);
-                    redo_stack->size--;
-                    undo_stack->size++;
+    } else if (command == SEARCH || command == REGEX_SEARCH || command == WRITE){ //the pattern or the file name is on the following line
+        getchar_unlocked();
+        read_text_line(b);
+    }
+    if (r->timestamps)
+        cmd->arrival_ns = monotonic_ns();
+
+    return cmd->command;
+}
+
+void output_create(output_t* out)
+{
+    out->buffer = (char*) malloc(OUTPUT_CHUNK_SIZE);
+    out->size = 0;
+    out->interactive = isatty(STDOUT_FILENO);
+    out->traced = 0;
+    out->trace_offset = 0;
+#ifdef PIPELINE
+    out->pipeline = NULL;
+#endif
+}
+
+void output_flush(output_t* out)
+{
+    if (out->traced)
+        output_trace(out);
+#ifdef PIPELINE
+    if (out->pipeline){
+        char* chunk;
+        size_t* chunk_size;
+
+        if (out->size == 0)
+            return;
+        chunk = out->buffer;
+        chunk_size = (size_t*) (chunk + OUTPUT_CHUNK_SIZE); //the size of a chunk travels in the bytes that follow it
+        *chunk_size = out->size;
+        ring_push(&out->pipeline->full_chunks, chunk);
+        if (!(out->buffer = (char*) ring_try_pop(&out->pipeline->free_chunks)))
+            out->buffer = (char*) malloc(OUTPUT_CHUNK_SIZE + sizeof(size_t));
+        out->size = 0;
+        out->trace_offset = 0;
+        return;
+    }
+#endif
+    fwrite(out->buffer, 1, out->size, stdout);
+    if (out->interactive)
+        fflush(stdout);
+    out->size = 0;
+    out->trace_offset = 0;
+}
+
+void output_line(output_t* out, char* text_line)
+{
+    size_t length = strlen(text_line);
+
+    if (out->size + length > OUTPUT_CHUNK_SIZE)
+        output_flush(out);
+    memcpy(out->buffer + out->size, text_line, length);
+    out->size += length;
+}
+
+void output_number(output_t* out, long n)
+{
+    char digits[24];
+    int length = 0;
+
+    if (out->size + sizeof(digits) > OUTPUT_CHUNK_SIZE)
+        output_flush(out);
+    do {
+        digits[length++] = (char) ('0' + n%10);
+        n = n/10;
+    } while (n > 0);
+    while (length > 0)
+        out->buffer[out->size++] = digits[--length];
+    out->buffer[out->size++] = NEWLINE;
+}
+
+void output_bytes(output_t* out, const char* data, size_t size)
+{
+    int direct = !out->traced; //the trace hashes the output in the buffer
+    size_t n;
+
+#ifdef PIPELINE
+    direct = direct && !out->pipeline;
+#endif
+    if (direct && out->size + size > OUTPUT_CHUNK_SIZE && size > OUTPUT_CHUNK_SIZE){
+        output_flush(out);
+        fwrite(data, 1, size, stdout);
+        if (out->interactive)
+            fflush(stdout);
+        return;
+    }
+    while (size > 0){
+        if (out->size == OUTPUT_CHUNK_SIZE)
+            output_flush(out);
+        n = OUTPUT_CHUNK_SIZE - out->size < size ? OUTPUT_CHUNK_SIZE - out->size : size;
+        memcpy(out->buffer + out->size, data, n);
+        out->size += n;
+        data += n;
+        size -= n;
+    }
+}
+
+void output_empty_line(output_t* out)
+{
+    if (out->size + 2 > OUTPUT_CHUNK_SIZE)
+        output_flush(out);
+    out->buffer[out->size++] = POINT;
+    out->buffer[out->size++] = NEWLINE;
+}
+
+void editor_create(editor_t* e)
+{
+    e->t = (tree_t*)malloc(sizeof(tree_t));
+    e->undo_stack = (stack_t*)malloc(sizeof(stack_t));
+    e->redo_stack = (stack_t*)malloc(sizeof(stack_t));
+
+    tree_create(e->t);
+    stack_create(e->undo_stack);
+    stack_create(e->redo_stack);
+    e->command_id = 1;
+    e->do_pending = 0;
+    e->start_do = 0;
+    e->group_depth = 0;
+    e->group_edits = 0;
+    memset(&e->group_lines, 0, sizeof(line_map_t));
+    e->group_lines_shifts = 0;
+    history_spill_create(&e->history, getenv("HISTORY_MEMORY_BUDGET") ? atol(getenv("HISTORY_MEMORY_BUDGET")) : HISTORY_MEMORY_BUDGET,
+                         getenv("HISTORY_HOT_BUDGET") ? atol(getenv("HISTORY_HOT_BUDGET")) : HISTORY_HOT_BUDGET);
+    e->level = 0;
+    e->levels_capacity = 1024;
+    e->level_parent = (int*) malloc(e->levels_capacity * sizeof(int));
+    e->level_depth = (int*) malloc(e->levels_capacity * sizeof(int));
+    e->level_branch = (int*) malloc(e->levels_capacity * sizeof(int));
+    e->level_parent[0] = 0;
+    e->level_depth[0] = 0;
+    e->branches = NULL;
+    e->branches_size = 0;
+    output_create(&e->output);
+    trace_open(&e->trace, getenv("EDITOR_TRACE"));
+    e->output.traced = e->trace.file != NULL;
+    e->version = 0;
+    memset(&e->prints, 0, sizeof(print_cache_t));
+#ifdef MERKLE_HASH
+    memset(&e->mark, 0, sizeof(version_t));
+    tree_version_take(e->t, &e->mark); //the empty document
+#endif
+}
+
+int compare_texts(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t) *(char* const*) a;
+    uintptr_t y = (uintptr_t) *(char* const*) b;
+
+    return (x > y) - (x < y);
+}
+
+void editor_destroy(editor_t* e)
+{
+    list_of_commands_t* x;
+    list_of_commands_t* next;
+    node_t* n;
+    char** texts;
+    long size = 0, capacity = e->t->number_of_keys + 1024;
+    long i;
+
+    //a text can be shared by the tree and by many commands: the pointers are collected and every distinct one is freed once
+    texts = (char**) malloc(capacity * sizeof(char*));
+    tree_apply_key_shifts(e->t);
+    for (n = tree_lower_bound(e->t, 1); n != e->t->nil; n = tree_successor(e->t, n))
+        texts[size++] = n->text_line;
+    for (i = -2; i < e->branches_size; i++){
+        x = i == -2 ? e->undo_stack->top : i == -1 ? e->redo_stack->top : e->branches[i].top;
+        for (; x; x = next){
+            next = x->next;
+            //the empty text of the placeholders and of the compressed tails is a constant, the text of a change to redo is taken from the tree when it is redone
+            if ((i == -2 || x->command != CHANGE) && x->text_line[0] != '\0'){
+                if (size == capacity){
+                    capacity *= 2;
+                    texts = (char**) realloc(texts, capacity * sizeof(char*));
                 }
+                texts[size++] = x->text_line;
             }
+            free(x);
         }
+    }
+    qsort(texts, size, sizeof(char*), compare_texts);
+    for (i = 0; i < size; i++){
+        if (i == 0 || texts[i] != texts[i-1])
+            free(texts[i]);
+    }
+    free(texts);
 
-        if (command == CHANGE){
-            getchar_unlocked();
-            for (line_number = start; line_number <= end; line_number++){
-                fgets(text, MAXLINESIZE+1, stdin);
-                effective_string = malloc(strlen(text)+1);
-                strcpy(effective_string, text);
-                tree_insert (t, line_number, effective_string, command_id, undo_stack);
-            }
-            undo_stack->size++;
-            make_empty_stack(redo_stack);
+    tree_destroy(e->t);
+#ifdef NGRAM_INDEX
+    ngram_index_destroy(e->t->index);
+#endif
+    free(e->t->nil);
+    free(e->t);
+    free(e->undo_stack);
+    free(e->redo_stack);
+    history_spill_destroy(&e->history);
+    free(e->group_lines.keys);
+    free(e->group_lines.values);
+    free(e->level_parent);
+    free(e->level_depth);
+    free(e->level_branch);
+    free(e->branches);
+    free(e->output.buffer);
+    if (e->trace.file)
+        fclose(e->trace.file);
+    free(e->trace.texts);
+    for (i = 0; i < PRINT_CACHE_SIZE; i++){
+        free(e->prints.entries[i].buffer);
+        free(e->prints.entries[i].offsets);
+    }
+#ifdef MERKLE_HASH
+    free(e->mark.prefix);
+    free(e->mark.powers);
+#endif
+}
 
-            command_id++;
+void line_map_clear(line_map_t* m) //the table is dropped when it is big, so that clearing never costs more than filling it
+{
+    if (m->capacity > 1024){
+        free(m->keys);
+        free(m->values);
+        m->keys = NULL;
+        m->values = NULL;
+        m->capacity = 0;
+    } else if (m->size > 0)
+        memset(m->keys, 0, m->capacity * sizeof(int));
+    m->size = 0;
+}
+
+list_of_commands_t** line_map_slot(line_map_t* m, int key) //slot of the key, NULL if absent and the table is full
+{
+    unsigned int i;
+
+    if (m->capacity == 0)
+        return NULL;
+    i = ((unsigned int) key * 2654435761U) & (m->capacity - 1);
+    while (m->keys[i] != 0 && m->keys[i] != key)
+        i = (i + 1) & (m->capacity - 1);
+    if (m->keys[i] == 0)
+        return NULL;
+    return &m->values[i];
+}
+
+void line_map_put(line_map_t* m, int key, list_of_commands_t* value)
+{
+    int* old_keys = m->keys;
+    list_of_commands_t** old_values = m->values;
+    int old_capacity = m->capacity;
+    unsigned int i;
+    int j;
+
+    if (2*(m->size+1) > m->capacity){ //keeps the table at most half full
+        m->capacity = m->capacity ? 2*m->capacity : 64;
+        m->keys = (int*) calloc(m->capacity, sizeof(int));
+        m->values = (list_of_commands_t**) malloc(m->capacity * sizeof(list_of_commands_t*));
+        m->size = 0;
+        for (j = 0; j < old_capacity; j++)
+            if (old_keys[j] != 0)
+                line_map_put(m, old_keys[j], old_values[j]);
+        free(old_keys);
+        free(old_values);
+    }
+    i = ((unsigned int) key * 2654435761U) & (m->capacity - 1);
+    while (m->keys[i] != 0 && m->keys[i] != key)
+        i = (i + 1) & (m->capacity - 1);
+    if (m->keys[i] == 0)
+        m->size++;
+    m->keys[i] = key;
+    m->values[i] = value;
+}
+
+void editor_begin_group(editor_t* e)
+{
+    if (e->group_depth == 0)
+        e->group_edits = 0;
+    e->group_depth++;
+}
+
+void editor_commit_group(editor_t* e)
+{
+    if (e->group_depth == 0)
+        return;
+    e->group_depth--;
+    if (e->group_depth > 0)
+        return;
+    line_map_clear(&e->group_lines);
+    if (e->group_edits > 0) //an empty group does not add an undo level
+        editor_add_level(e);
+}
+
+int compare_edits(const void* a, const void* b)
+{
+    const edit_t* x = (const edit_t*) a;
+    const edit_t* y = (const edit_t*) b;
+
+    if (x->address != y->address)
+        return (x->address > y->address) - (x->address < y->address);
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+void editor_batch_change(editor_t* e, edit_t* edits, int size)
+{
+    int i, n = 0, inside;
+
+    qsort(edits, size, sizeof(edit_t), compare_edits);
+    for (i = 0; i < size; i++){ //keeps the last change of every line
+        if (edits[i].address < 1 || (i+1 < size && edits[i+1].address == edits[i].address))
+            free(edits[i].text_line);
+        else
+            edits[n++] = edits[i];
+    }
+    if (n == 0) //like a delete outside the document, an empty batch still counts as a command
+        stack_push_values(e->undo_stack, -1, -1, e->command_id, CHANGE, "\0");
+    for (inside = 0; inside < n && edits[inside].address <= e->t->number_of_keys; inside++)
+        ;
+    for (i = inside; i < n; i++) //the addresses past the end are appended in order, without leaving holes
+        edits[i].address = e->t->number_of_keys + 1 + (i - inside);
+
+    if (e->group_depth > 0){
+        for (i = 0; i < n; i++)
+            editor_group_insert(e, edits[i].address, edits[i].text_line);
+        editor_stash_redo(e);
+        e->group_edits++;
+        return;
+    }
+    tree_batch_change(e->t, edits, inside, e->command_id, e->undo_stack);
+    for (i = inside; i < n; i++) //lines added at the end of the document
+        tree_insert(e->t, edits[i].address, edits[i].text_line, e->command_id, e->undo_stack);
+    editor_stash_redo(e);
+    editor_add_level(e);
+}
+
+void editor_group_insert(editor_t* e, int key, char* text_line)
+{
+    list_of_commands_t** last_change;
+    char* previous;
+    node_t* y;
+    int stored_key;
+
+    if (e->group_lines_shifts != e->t->shifts_applied){ //the keys of the nodes have been renumbered
+        line_map_clear(&e->group_lines);
+        e->group_lines_shifts = e->t->shifts_applied;
+    }
+    stored_key = tree_stored_key(e->t, key);
+    last_change = line_map_slot(&e->group_lines, stored_key);
+    if (last_change){
+        y = tree_search(e->t, stored_key);
+        previous = y->text_line;
+        tree_set_text(e->t, y, text_line);
+        free(previous); //it was added by this group, nothing else refers to it
+        (*last_change)->text_line = text_line;
+        return;
+    }
+    tree_insert(e->t, key, text_line, e->command_id, e->undo_stack);
+    line_map_put(&e->group_lines, stored_key, e->undo_stack->top); //the command that deletes (undoes) the new text
+}
+
+long long monotonic_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int command_text_lines(command_t* cmd)
+{
+    if (cmd->command == CHANGE)
+        return cmd->end >= cmd->start ? cmd->end - cmd->start + 1 : 0;
+    if (cmd->command == BATCH_CHANGE)
+        return cmd->start > 0 ? cmd->start : 0;
+    if (cmd->command == SEARCH || cmd->command == REGEX_SEARCH || cmd->command == WRITE)
+        return 1;
+    return 0;
+}
+
+void trace_open(trace_t* tr, const char* path)
+{
+    tr->file = NULL;
+    tr->texts = NULL;
+    tr->texts_size = 0;
+    tr->texts_capacity = 0;
+    if (!path || !path[0])
+        return;
+    tr->file = fopen(path, "wb");
+    if (!tr->file){
+        fprintf(stderr, "Cannot write the trace in %s\n", path);
+        return;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), tr->file);
+}
+
+void trace_append(trace_t* tr, const void* data, size_t size) //appends bytes to the serialized text lines of the command
+{
+    if (tr->texts_size + size > tr->texts_capacity){
+        tr->texts_capacity = 2*(tr->texts_size + size);
+        tr->texts = (char*) realloc(tr->texts, tr->texts_capacity);
+    }
+    memcpy(tr->texts + tr->texts_size, data, size);
+    tr->texts_size += size;
+}
+
+void output_trace(output_t* out)
+{
+    unsigned long long hash = out->trace_hash;
+    size_t i;
+
+    for (i = out->trace_offset; i < out->size; i++)
+        hash = (hash ^ (unsigned char) out->buffer[i]) * FNV_PRIME;
+    out->trace_hash = hash;
+    out->trace_bytes += (long long) (out->size - out->trace_offset);
+    out->trace_offset = out->size;
+}
+
+void trace_write_record(trace_t* tr, trace_record_t* record) //writes a record followed by the text lines serialized in the trace
+{
+    //field by field: the records have no padding
+    fwrite(&record->command, sizeof(char), 1, tr->file);
+    fwrite(&record->start, sizeof(int), 1, tr->file);
+    fwrite(&record->end, sizeof(int), 1, tr->file);
+    fwrite(&record->lines, sizeof(int), 1, tr->file);
+    fwrite(&record->arrival_ns, sizeof(long long), 1, tr->file);
+    fwrite(&record->completion_ns, sizeof(long long), 1, tr->file);
+    fwrite(&record->output_bytes, sizeof(long long), 1, tr->file);
+    fwrite(&record->output_hash, sizeof(unsigned long long), 1, tr->file);
+    fwrite(tr->texts, 1, tr->texts_size, tr->file);
+}
+
+void editor_execute_traced(editor_t* e, command_batch_t* b, command_t* cmd)
+{
+    trace_t* tr = &e->trace;
+    trace_record_t record;
+    short length;
+    int i;
+
+    if (!tr->file){
+        editor_execute(e, b, cmd);
+        return;
+    }
+    record.arrival_ns = cmd->arrival_ns;
+    tr->texts_size = 0;
+    if (e->do_pending && cmd->command != UNDO && cmd->command != REDO){ //the history is not charged to the command that happens to apply it
+        record.command = TRACE_APPLY_DO;
+        record.start = e->start_do;
+        record.end = 0;
+        record.lines = 0;
+        editor_apply_do(e);
+        record.completion_ns = monotonic_ns();
+        record.output_bytes = 0;
+        record.output_hash = FNV_OFFSET;
+        trace_write_record(tr, &record);
+        record.arrival_ns = record.completion_ns;
+    }
+    record.command = cmd->command;
+    record.start = cmd->start;
+    record.end = cmd->end;
+    record.lines = command_text_lines(cmd);
+    for (i = 0; i < record.lines; i++){ //the texts are saved before the tree takes (and may free) them
+        char* text_line = b->text_lines[cmd->first_line + i];
+
+        if (cmd->command == BATCH_CHANGE)
+            trace_append(tr, &b->text_addresses[cmd->first_line + i], sizeof(int));
+        length = (short) strlen(text_line);
+        trace_append(tr, &length, sizeof(short));
+        trace_append(tr, text_line, length);
+    }
+    e->output.trace_hash = FNV_OFFSET;
+    e->output.trace_bytes = 0;
+
+    editor_execute(e, b, cmd);
+
+    output_trace(&e->output);
+    record.completion_ns = monotonic_ns();
+    record.output_bytes = e->output.trace_bytes;
+    record.output_hash = e->output.trace_hash;
+    trace_write_record(tr, &record);
+    if (cmd->command == QUIT)
+        fflush(tr->file);
+}
+
+int trace_read_record(FILE* f, trace_record_t* record, command_batch_t* b)
+{
+    command_t* cmd;
+    short length;
+    int i;
+
+    if (fread(&record->command, sizeof(char), 1, f) != 1)
+        return 0;
+    if (fread(&record->start, sizeof(int), 1, f) != 1 || fread(&record->end, sizeof(int), 1, f) != 1 || fread(&record->lines, sizeof(int), 1, f) != 1 ||
+        fread(&record->arrival_ns, sizeof(long long), 1, f) != 1 || fread(&record->completion_ns, sizeof(long long), 1, f) != 1 ||
+        fread(&record->output_bytes, sizeof(long long), 1, f) != 1 || fread(&record->output_hash, sizeof(unsigned long long), 1, f) != 1)
+        return 0;
+
+    batch_clear(b);
+    cmd = &b->commands[b->size++];
+    cmd->command = record->command;
+    cmd->start = record->start;
+    cmd->end = record->end;
+    cmd->first_line = 0;
+    cmd->arrival_ns = record->arrival_ns;
+    if (record->lines > b->text_lines_capacity){
+        b->text_lines_capacity = record->lines;
+        b->text_lines = (char**) realloc(b->text_lines, b->text_lines_capacity * sizeof(char*));
+        b->text_addresses = (int*) realloc(b->text_addresses, b->text_lines_capacity * sizeof(int));
+    }
+    for (i = 0; i < record->lines; i++){
+        if (record->command == BATCH_CHANGE && fread(&b->text_addresses[i], sizeof(int), 1, f) != 1)
+            return 0;
+        if (fread(&length, sizeof(short), 1, f) != 1 || length < 0 || length > MAXLINESIZE)
+            return 0;
+        b->text_lines[i] = (char*) malloc(length+1);
+        if (fread(b->text_lines[i], 1, length, f) != (size_t) length)
+            return 0;
+        b->text_lines[i][length] = '\0';
+        b->text_lines_size++;
+    }
+    return 1;
+}
+
+void print_entry_release(print_entry_t* entry) //frees the lines of an entry, its range is still remembered
+{
+    free(entry->buffer);
+    free(entry->offsets);
+    entry->buffer = NULL;
+    entry->size = 0;
+    entry->offsets = NULL;
+    entry->offsets_capacity = 0;
+}
+
+void print_range(editor_t* e, node_t* x, int start, int end) //prints a range straight to the output, x is the node of start
+{
+    int a;
+
+    in_order_iterative(e->t, x, start, end, &e->output);
+    for (a = start > e->t->number_of_keys ? start : e->t->number_of_keys + 1; a <= end; a++)
+        output_empty_line(&e->output);
+}
+
+void editor_new_version(editor_t* e)
+{
+    int i;
+
+    e->version++;
+    for (i = 0; i < PRINT_CACHE_SIZE; i++)
+        if (e->prints.entries[i].buffer)
+            print_entry_release(&e->prints.entries[i]);
+}
+
+void editor_print(editor_t* e, int start, int end)
+{
+    print_cache_t* cache = &e->prints;
+    print_entry_t* entry;
+    print_entry_t* repeated = NULL;
+    tree_t* t = e->t;
+    node_t* x = NULL;
+    node_t* first;
+    char* text_line;
+    size_t size = 0;
+    int i, a;
+
+    for (i = 0; i < PRINT_CACHE_SIZE; i++){
+        entry = &cache->entries[i];
+        if (entry->end == 0 || entry->version != e->version)
+            continue;
+        if (entry->buffer && entry->start <= start && end <= entry->end){
+            cache->hits++;
+            output_bytes(&e->output, entry->buffer + entry->offsets[start - entry->start],
+                         entry->offsets[end - entry->start + 1] - entry->offsets[start - entry->start]);
+            return;
         }
+        if (!entry->buffer && entry->start == start && entry->end == end)
+            repeated = entry;
+    }
 
-        else if (command == DELETE){
-            getchar_unlocked();
+    cache->misses++;
+    if (start <= t->number_of_keys)
+        x = tree_search(t, start);
+    if (!repeated){ //first request of the range: it is only remembered, the lines go straight to the output
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % PRINT_CACHE_SIZE;
+        print_entry_release(entry);
+        entry->version = e->version;
+        entry->start = start;
+        entry->end = end;
+        print_range(e, x, start, end);
+        return;
+    }
 
-            tree_number_of_keys = t->number_of_keys;
-            for (line_number = start; line_number <= end; line_number++){
-                if (line_number > tree_number_of_keys || line_number < 1)
-                    stack_push_values(undo_stack, -1, -1, command_id, CHANGE, "\0");
-                else
-                    tree_delete(t, tree_search(t, line_number), command_id, undo_stack);
-            }
-            if(end < tree_number_of_keys){
-                tree_key_fixup(t, t->root, start, end);
-                stack_push_values(undo_stack, start, end, command_id, FIX_VALUES, "\0");
-            }
-            undo_stack->size++;
-            make_empty_stack(redo_stack);
+    //second request: the offsets are measured first, so that the buffer is allocated once
+    entry = repeated;
+    if (end - start + 2 > entry->offsets_capacity){
+        entry->offsets_capacity = end - start + 2;
+        entry->offsets = (size_t*) realloc(entry->offsets, entry->offsets_capacity * sizeof(size_t));
+    }
+    first = x;
+    for (a = start; a <= end; a++){
+        entry->offsets[a - start] = size;
+        size += a <= t->number_of_keys ? strlen(x->text_line) : 2;
+        if (size > PRINT_CACHE_MAX_BYTES){ //too long to be cached
+            print_entry_release(entry);
+            entry->end = 0;
+            print_range(e, first, start, end);
+            return;
+        }
+        if (a < t->number_of_keys)
+            x = tree_successor(t, x);
+    }
+    entry->offsets[end - start + 1] = size;
+    entry->buffer = (char*) malloc(size);
+    entry->size = size;
+    x = first;
+    for (a = start; a <= end; a++){
+        text_line = a <= t->number_of_keys ? x->text_line : ".\n";
+        memcpy(entry->buffer + entry->offsets[a - start], text_line, entry->offsets[a - start + 1] - entry->offsets[a - start]);
+        if (a < t->number_of_keys)
+            x = tree_successor(t, x);
+    }
+    output_bytes(&e->output, entry->buffer, size);
+}
+
+void editor_print_stats(editor_t* e, FILE* f)
+{
+    history_stats_t* stats = &e->history.stats;
+
+    fprintf(f, "history: %d undo levels, %d redo levels, %ld bytes uncompressed in memory\n", e->undo_stack->size, e->redo_stack->size,
+            e->undo_stack->bytes + e->redo_stack->bytes);
+    fprintf(f, "history: %ld segments compressed, %ld -> %ld bytes (ratio %.2f), %ld bytes compressed in memory\n",
+            stats->segments_compressed, stats->raw_bytes, stats->compressed_bytes,
+            stats->compressed_bytes ? (double) stats->raw_bytes / stats->compressed_bytes : 0.0, e->history.cold_bytes);
+    fprintf(f, "history: %ld segments written in the spill file, %d still there\n", stats->segments_written, e->history.segments_in_file);
+    fprintf(f, "history: %ld segments restored by undo and redo, %.3f ms average, %.3f ms max\n", stats->segments_restored,
+            stats->segments_restored ? stats->restore_ns / 1e6 / stats->segments_restored : 0.0, stats->max_restore_ns / 1e6);
+    fprintf(f, "prints: %ld served by the cache, %ld formatted\n", e->prints.hits, e->prints.misses);
+}
+
+void editor_undo_level(editor_t* e)
+{
+    int starting_command_id;
+    stack_t* undo_stack = e->undo_stack;
+    stack_t* redo_stack = e->redo_stack;
+
+    history_page_in(&e->history, undo_stack);
+    starting_command_id = undo_stack->top->command_id;
+    while (undo_stack->top != NULL && (undo_stack->top->command_id == starting_command_id))
+        undo_command(e->t, undo_stack, redo_stack);
+    undo_stack->size--;
+    redo_stack->size++;
+    e->level = e->level_parent[starting_command_id];
+    history_spill(&e->history, undo_stack, redo_stack);
+    editor_new_version(e);
+}
+
+void editor_redo_level(editor_t* e)
+{
+    int starting_command_id;
+    stack_t* undo_stack = e->undo_stack;
+    stack_t* redo_stack = e->redo_stack;
+
+    history_page_in_chain(&e->history, redo_stack);
+    starting_command_id = redo_stack->top->command_id;
+    while (redo_stack->top != NULL && (redo_stack->top->command_id == starting_command_id))
+        redo_command(e->t, undo_stack, redo_stack);
+    redo_stack->size--;
+    undo_stack->size++;
+    e->level = starting_command_id;
+    history_spill(&e->history, undo_stack, redo_stack);
+    editor_new_version(e);
+}
+
+void editor_apply_do(editor_t* e)
+{
+    int i;
+
+    tree_apply_key_shifts(e->t); //the history is replayed on the real keys
+    if (e->start_do > 0){
+        for (i = 0; i < e->start_do; i++)
+            editor_undo_level(e);
+    } else if (e->start_do < 0 ){
+        for (i = 0; i < (-e->start_do); i++)
+            editor_redo_level(e);
+    }
+    e->do_pending = 0;
+    e->start_do = 0;
+}
+
+void editor_add_level(editor_t* e)
+{
+    if (e->command_id == e->levels_capacity){
+        e->levels_capacity *= 2;
+        e->level_parent = (int*) realloc(e->level_parent, e->levels_capacity * sizeof(int));
+        e->level_depth = (int*) realloc(e->level_depth, e->levels_capacity * sizeof(int));
+        e->level_branch = (int*) realloc(e->level_branch, e->levels_capacity * sizeof(int));
+    }
+    e->level_parent[e->command_id] = e->level;
+    e->level_depth[e->command_id] = e->level_depth[e->level] + 1;
+    e->level = e->command_id;
+    e->undo_stack->size++;
+    history_spill(&e->history, e->undo_stack, e->redo_stack);
+    e->command_id++;
+}
+
+void editor_stash_redo(editor_t* e)
+{
+    branch_t* branch;
+    int slot;
+
+    if (e->redo_stack->top == NULL)
+        return;
+    for (slot = 0; slot < e->branches_size && e->branches[slot].top; slot++) //first free slot
+        ;
+    if (slot == e->branches_size){
+        e->branches_size++;
+        e->branches = (branch_t*) realloc(e->branches, e->branches_size * sizeof(branch_t));
+    }
+    branch = &e->branches[slot];
+    branch->top = e->redo_stack->top;
+    branch->size = e->redo_stack->size;
+    branch->bytes = e->redo_stack->bytes;
+    e->level_branch[branch->top->command_id] = slot; //a jump looks only for the first level of a branch: the other ones are reached through it
+    history_spill_chain(&e->history, branch->top, &branch->bytes, 0); //the branch is cold: only its first level stays uncompressed
+    e->redo_stack->top = NULL;
+    e->redo_stack->size = 0;
+    e->redo_stack->bytes = 0;
+}
+
+void editor_jump(editor_t* e, int target)
+{
+    branch_t branch;
+    int* path;
+    int path_size = 0;
+    int a, b, i;
+
+    if (target < 0 || target >= e->command_id || target == e->level)
+        return;
+    tree_apply_key_shifts(e->t);
+
+    //lowest common ancestor of the current level and the target, the path from the target up to it is saved
+    path = (int*) malloc((e->level_depth[target] + 1) * sizeof(int));
+    a = e->level;
+    b = target;
+    while (e->level_depth[a] > e->level_depth[b])
+        a = e->level_parent[a];
+    while (e->level_depth[b] > e->level_depth[a]){
+        path[path_size++] = b;
+        b = e->level_parent[b];
+    }
+    while (a != b){
+        a = e->level_parent[a];
+        path[path_size++] = b;
+        b = e->level_parent[b];
+    }
 
-            command_id++;
+    while (e->level != a)
+        editor_undo_level(e);
+    for (i = path_size-1; i >= 0; i--){
+        if (e->redo_stack->top == NULL || e->redo_stack->top->command_id != path[i]){ //the next level is the first one of a branch
+            branch = e->branches[e->level_branch[path[i]]];
+            e->branches[e->level_branch[path[i]]].top = NULL;
+            editor_stash_redo(e);
+            e->redo_stack->top = branch.top;
+            e->redo_stack->size = branch.size;
+            e->redo_stack->bytes = branch.bytes;
         }
+        editor_redo_level(e);
+    }
+    free(path);
+}
 
-        else if (command == PRINT){
-            getchar_unlocked();
-            while (start<1){
-                fputc_unlocked(POINT, stdout);
-                fputc_unlocked(NEWLINE, stdout);
-                start++;
-            }
-            if (start > t->number_of_keys){
-                for (i = start; i <= end; i++){
-                    fputc_unlocked(POINT, stdout);
-                    fputc_unlocked(NEWLINE, stdout);
-                }
-            } else {
-                in_order_iterative(t, tree_search(t, start), start, end);
-                for (i = t->number_of_keys; i < end; i++){
-                    fputc_unlocked(POINT, stdout);
-                    fputc_unlocked(NEWLINE, stdout);
-                }
-            }
+void editor_execute(editor_t* e, command_batch_t* b, command_t* cmd)
+{
+    int start = cmd->start;
+    int end = cmd->end;
+    int i, a;
+    int line_number;
+    int tree_number_of_keys;
+    tree_t* t = e->t;
+    stack_t* undo_stack = e->undo_stack;
+
+    //undo-s are counted as positive, redo-s as negative
+    if (cmd->command == UNDO || cmd->command == REDO){
+        while (e->group_depth > 0) //undo and redo close the open group
+            editor_commit_group(e);
+        if (!e->do_pending){
+            e->do_pending = 1;
+            e->start_do = 0;
+            e->temporary_undo_stack_size = undo_stack->size;
+            e->temporary_redo_stack_size = e->redo_stack->size;
+        }
+        if (cmd->command == UNDO){
+            a = min(start, e->temporary_undo_stack_size);
+            e->start_do = e->start_do + a;
+            e->temporary_undo_stack_size = e->temporary_undo_stack_size - a;
+            e->temporary_redo_stack_size = e->temporary_redo_stack_size + a;
+        } else {
+            a = min(start, e->temporary_redo_stack_size);
+            e->start_do = e->start_do - a;
+            e->temporary_redo_stack_size = e->temporary_redo_stack_size - a;
+            e->temporary_undo_stack_size = e->temporary_undo_stack_size + a;
+        }
+        return;
+    }
+    if (e->do_pending)
+        editor_apply_do(e);
+
+    if (cmd->command == CHANGE){
+        editor_new_version(e);
+        for (line_number = start; line_number <= end; line_number++){
+            if (e->group_depth > 0)
+                editor_group_insert(e, line_number, b->text_lines[cmd->first_line + line_number - start]);
+            else
+                tree_insert (t, line_number, b->text_lines[cmd->first_line + line_number - start], e->command_id, undo_stack);
+        }
+        editor_stash_redo(e);
+        if (e->group_depth > 0){
+            e->group_edits++;
+            return;
+        }
+        editor_add_level(e);
+    }
+
+    else if (cmd->command == DELETE){
+        tree_number_of_keys = t->number_of_keys;
+        if (start <= tree_number_of_keys && end >= 1)
+            editor_new_version(e);
+        for (line_number = start; line_number <= end; line_number++){
+            if (line_number > tree_number_of_keys || line_number < 1)
+                stack_push_values(undo_stack, -1, -1, e->command_id, CHANGE, "\0");
+            else
+                tree_delete(t, tree_search(t, tree_stored_key(t, line_number)), e->command_id, undo_stack);
+        }
+        if(end < tree_number_of_keys){
+            tree_log_key_shift(t, start, end); //the keys are shifted only when a print or an undo/redo needs them
+            stack_push_values(undo_stack, start, end, e->command_id, FIX_VALUES, "\0");
+        }
+        editor_stash_redo(e);
+        if (e->group_depth > 0){
+            e->group_edits++;
+            if (start <= tree_number_of_keys && end >= tree_number_of_keys) //the keys of the last lines are given again to the lines appended later
+                line_map_clear(&e->group_lines);
+            return;
+        }
+        editor_add_level(e);
+    }
+
+    else if (cmd->command == BATCH_CHANGE){
+        edit_t* edits = (edit_t*) malloc((start > 0 ? start : 1) * sizeof(edit_t));
+
+        editor_new_version(e);
+
+        for (i = 0; i < start; i++){
+            edits[i].address = b->text_addresses[cmd->first_line + i];
+            edits[i].order = i;
+            edits[i].text_line = b->text_lines[cmd->first_line + i];
+        }
+        editor_batch_change(e, edits, start > 0 ? start : 0);
+        free(edits);
+    }
+
+    else if (cmd->command == JUMP){
+        while (e->group_depth > 0)
+            editor_commit_group(e);
+        editor_jump(e, start);
+    }
+
+    else if (cmd->command == SEARCH || cmd->command == REGEX_SEARCH){
+        char* pattern = b->text_lines[cmd->first_line];
+        size_t length = strlen(pattern);
+        int* matches;
+        int n;
+
+        if (length > 0 && pattern[length-1] == NEWLINE)
+            pattern[length-1] = '\0';
+        n = tree_find(t, start, end, pattern, cmd->command == REGEX_SEARCH, &matches);
+        for (i = 0; i < n; i++)
+            output_number(&e->output, matches[i]);
+        output_empty_line(&e->output); //the list of addresses ends with a line with a point
+        free(matches);
+        free(pattern);
+        if (e->output.interactive)
+            output_flush(&e->output);
+    }
+
+    else if (cmd->command == WRITE){
+        char* path = b->text_lines[cmd->first_line];
+        size_t length = strlen(path);
+        long written;
+
+        if (length > 0 && path[length-1] == NEWLINE)
+            path[length-1] = '\0';
+        written = tree_save(t, path);
+        if (written < 0)
+            output_line(&e->output, "?\n");
+        else
+            output_number(&e->output, written);
+        free(path);
+        if (e->output.interactive)
+            output_flush(&e->output);
+    }
+
+    else if (cmd->command == OFFSET){
+        line_number = tree_offset_line(t, start);
+        if (line_number)
+            output_number(&e->output, line_number);
+        else
+            output_empty_line(&e->output);
+        if (e->output.interactive)
+            output_flush(&e->output);
+    }
+
+#ifdef MERKLE_HASH
+    else if (cmd->command == MARK){
+        tree_apply_key_shifts(t);
+        tree_version_take(t, &e->mark);
+    }
+
+    else if (cmd->command == COMPARE){
+        int* lines;
+        int n = tree_version_diff(t, &e->mark, &lines);
+
+        for (i = 0; i < n; i++)
+            output_number(&e->output, lines[i]);
+        output_empty_line(&e->output); //the list of addresses ends with a line with a point
+        free(lines);
+        if (e->output.interactive)
+            output_flush(&e->output);
+    }
+#endif
+
+    else if (cmd->command == BEGIN_GROUP)
+        editor_begin_group(e);
+
+    else if (cmd->command == COMMIT_GROUP)
+        editor_commit_group(e);
+
+    else if (cmd->command == QUIT){
+        while (e->group_depth > 0)
+            editor_commit_group(e);
+    }
+
+    else if (cmd->command == PRINT){
+        tree_apply_key_shifts(t);
+        while (start<1){
+            output_empty_line(&e->output);
+            start++;
+        }
+        if (start <= end)
+            editor_print(e, start, end);
+        if (e->output.interactive)
+            output_flush(&e->output);
+    }
+}
+
+#ifdef PIPELINE
+void ring_create(ring_t* r)
+{
+    r->head = 0;
+    r->tail = 0;
+    r->parked = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+}
+
+void ring_destroy(ring_t* r)
+{
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+}
+
+void ring_park(ring_t* r, unsigned long* index, unsigned long value) //sleeps until the other side moves the index away from value
+{
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->parked, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value)
+        pthread_cond_wait(&r->wake, &r->lock);
+    __atomic_store_n(&r->parked, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void ring_wake(ring_t* r) //wakes the other side of the ring if it is parked
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //a stage parking after this point sees the index just moved
+    if (__atomic_load_n(&r->parked, __ATOMIC_RELAXED)){
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+void ring_push(ring_t* r, void* item)
+{
+    unsigned long tail = r->tail;
+    int spins = 0;
+
+    while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_CAPACITY){
+        if (++spins > RING_SPINS)
+            ring_park(r, &r->head, tail - RING_CAPACITY);
+    }
+    r->slots[tail & (RING_CAPACITY-1)] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE); //publishes the slot only after it has been written
+    ring_wake(r);
+}
+
+void* ring_pop(ring_t* r)
+{
+    unsigned long head = r->head;
+    void* item;
+    int spins = 0;
+
+    while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head){
+        if (++spins > RING_SPINS)
+            ring_park(r, &r->tail, head);
+    }
+    item = r->slots[head & (RING_CAPACITY-1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    ring_wake(r);
+
+    return item;
+}
+
+int ring_try_push(ring_t* r, void* item)
+{
+    unsigned long tail = r->tail;
+
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_CAPACITY)
+        return 0;
+    r->slots[tail & (RING_CAPACITY-1)] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    ring_wake(r);
+
+    return 1;
+}
+
+void* ring_try_pop(ring_t* r)
+{
+    unsigned long head = r->head;
+    void* item;
+
+    if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+        return NULL;
+    item = r->slots[head & (RING_CAPACITY-1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    ring_wake(r);
+
+    return item;
+}
+
+void* reader_thread(void* arg)
+{
+    pipeline_t* p = (pipeline_t*) arg;
+    reader_t r = {0, 0, 0};
+    command_batch_t* b;
+    char command;
+
+    r.timestamps = p->timestamps;
+    do {
+        if (!(b = (command_batch_t*) ring_try_pop(&p->free_batches)))
+            b = batch_create();
+        batch_clear(b);
+        do {
+            command = read_command(&r, b);
+        } while (command != QUIT && !p->interactive && b->size < COMMAND_BATCH_SIZE && b->text_lines_size < COMMAND_BATCH_LINES);
+        ring_push(&p->full_batches, b);
+    } while (command != QUIT);
+
+    return NULL;
+}
+
+void* writer_thread(void* arg)
+{
+    pipeline_t* p = (pipeline_t*) arg;
+    char* chunk;
+
+    size_t size, written;
+    ssize_t n;
+
+    while ((chunk = (char*) ring_pop(&p->full_chunks))){ //a NULL chunk marks the end of the output
+        size = *(size_t*) (chunk + OUTPUT_CHUNK_SIZE);
+        for (written = 0; written < size; written += n) //the chunks are big enough to bypass the buffering of stdio, so a terminal sees every chunk at once
+            if ((n = write(STDOUT_FILENO, chunk + written, size - written)) <= 0)
+                break;
+        if (!ring_try_push(&p->free_chunks, chunk))
+            free(chunk);
+    }
+
+    return NULL;
+}
+
+void pipeline_run(editor_t* e)
+{
+    pipeline_t* p = (pipeline_t*) malloc(sizeof(pipeline_t));
+    pthread_t reader, writer;
+    command_batch_t* b;
+    char* chunk;
+    int i;
+    char command = 0;
+
+    ring_create(&p->full_batches);
+    ring_create(&p->free_batches);
+    ring_create(&p->full_chunks);
+    ring_create(&p->free_chunks);
+    free(e->output.buffer);
+    e->output.buffer = (char*) malloc(OUTPUT_CHUNK_SIZE + sizeof(size_t));
+    e->output.pipeline = p;
+    p->timestamps = e->trace.file != NULL;
+    p->interactive = e->output.interactive; //a terminal gets the output of every print before the next command is typed
+
+    pthread_create(&reader, NULL, reader_thread, p);
+    pthread_create(&writer, NULL, writer_thread, p);
+
+    do {
+        b = (command_batch_t*) ring_pop(&p->full_batches);
+        for (i = 0; i < b->size; i++){
+            command = b->commands[i].command;
+            editor_execute_traced(e, b, &b->commands[i]);
         }
+        if (command != QUIT && !ring_try_push(&p->free_batches, b)) //the batches given back never block the engine
+            batch_destroy(b);
+    } while (command != QUIT);
+
+    output_flush(&e->output);
+    ring_push(&p->full_chunks, NULL);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    batch_destroy(b);
+    while ((b = (command_batch_t*) ring_try_pop(&p->free_batches)))
+        batch_destroy(b);
+    while ((chunk = (char*) ring_try_pop(&p->free_chunks)))
+        free(chunk);
+    e->output.pipeline = NULL;
+    ring_destroy(&p->full_batches);
+    ring_destroy(&p->free_batches);
+    ring_destroy(&p->full_chunks);
+    ring_destroy(&p->free_chunks);
+    free(p);
+}
+#endif
+
+#ifndef EDITOR_NO_MAIN //the microbenchmarks include this file with their own main
+int main () {
+
+#ifndef PIPELINE
+    reader_t r = {0, 0, 0};
+    command_batch_t* b = batch_create();
+    char command;
+#endif
+    editor_t* e = (editor_t*)malloc(sizeof(editor_t));
+
+    editor_create(e);
+#ifdef PIPELINE
+    pipeline_run(e);
+#else
+    r.timestamps = e->trace.file != NULL;
+    do {
+        batch_clear(b);
+        command = read_command(&r, b);
+        editor_execute_traced(e, b, &b->commands[0]);
     } while (command != QUIT);
+    output_flush(&e->output);
+    batch_destroy(b);
+#endif
+    if (getenv("EDITOR_STATS"))
+        editor_print_stats(e, stderr);
+    if (e->trace.file)
+        fclose(e->trace.file);
+    //the editor is not destroyed: the process gives all its memory back at once, without visiting every text (microbench and replay use editor_destroy)
 
     return 0;
 }
+#endif
 
-void in_order_iterative (tree_t * t, node_t* x, int start, int end)
+void in_order_iterative (tree_t * t, node_t* x, int start, int end, output_t* out)
 {
     while ((start <= end) && (start <= t->number_of_keys)){
-        fputs(x->text_line, stdout);
+        output_line(out, x->text_line);
         x = tree_successor(t,x);
         start++;
     }
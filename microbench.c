@@ -0,0 +1,305 @@
+/*
+ * Microbenchmarks of the tree and of the history of the editor.
+ * Every benchmark drives the functions of main.c directly on a synthetic sequence of operations, outside of the parsing and of the output, and prints a
+ * line of comma separated values: name, number of operations, nanoseconds per operation and cache misses per operation (-1 when the counter is not available).
+ * Usage: microbench [operations]
+ */
+#define EDITOR_NO_MAIN
+#include "main.c"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* ------------------------------------------------------------------------------------------ constants ------------------------------------------------------------------------------------------ */
+#define BENCH_OPERATIONS 100000
+#define BENCH_SEED 12345
+#define BENCH_TEXT_SIZE 24
+
+/* ------------------------------------------------------------------------------------------ structs ------------------------------------------------------------------------------------------ */
+/**
+ * Time and hardware counter of a measured section
+ */
+typedef struct bench_timer_s{
+    struct timespec begin;
+    int fd; //cache miss counter, -1 if perf events are not available
+} bench_timer_t;
+
+/* ------------------------------------------------------------------------------------------ benchmark prototypes ------------------------------------------------------------------------------------------ */
+/**
+ * Starts measuring a section
+ * @param timer timer to start
+ */
+void bench_start(bench_timer_t* timer);
+
+/**
+ * Stops measuring a section and prints its result
+ * @param timer timer started by bench_start
+ * @param name name of the benchmark
+ * @param operations operations done in the section
+ */
+void bench_stop(bench_timer_t* timer, const char* name, long operations);
+
+/**
+ * Allocates the texts used by a benchmark, the tree takes their ownership
+ * @param n number of texts
+ * @return the texts
+ */
+char** bench_texts(int n);
+
+/**
+ * Creates an editor whose document has n lines
+ * @param n number of lines
+ * @return the editor
+ */
+editor_t* bench_editor(int n);
+
+/**
+ * Frees an editor with its document and its history, so that the next benchmark starts from a clean heap
+ * @param e editor created by bench_editor
+ */
+void bench_editor_destroy(editor_t* e);
+
+/* ------------------------------------------------------------------------------------------ functions ------------------------------------------------------------------------------------------ */
+void bench_start(bench_timer_t* timer)
+{
+    timer->fd = -1;
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(struct perf_event_attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(struct perf_event_attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    timer->fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (timer->fd != -1){
+        ioctl(timer->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(timer->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &timer->begin);
+}
+
+void bench_stop(bench_timer_t* timer, const char* name, long operations)
+{
+    struct timespec end;
+    long long misses = -1;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#ifdef __linux__
+    if (timer->fd != -1){
+        ioctl(timer->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(timer->fd, &misses, sizeof(long long)) != sizeof(long long))
+            misses = -1;
+        close(timer->fd);
+    }
+#endif
+    ns = (double) (end.tv_sec - timer->begin.tv_sec) * 1e9 + (double) (end.tv_nsec - timer->begin.tv_nsec);
+    if (operations < 1)
+        operations = 1;
+    printf("%s,%ld,%.1f,%.2f\n", name, operations, ns / operations, misses < 0 ? -1.0 : (double) misses / operations);
+    fflush(stdout);
+}
+
+char** bench_texts(int n)
+{
+    char** texts = (char**) malloc(n * sizeof(char*));
+    int i;
+
+    for (i = 0; i < n; i++){
+        texts[i] = (char*) malloc(BENCH_TEXT_SIZE);
+        snprintf(texts[i], BENCH_TEXT_SIZE, "line %d\n", rand());
+    }
+    return texts;
+}
+
+editor_t* bench_editor(int n)
+{
+    editor_t* e = (editor_t*) malloc(sizeof(editor_t));
+    char** texts = bench_texts(n);
+    int i;
+
+    editor_create(e);
+    for (i = 0; i < n; i++)
+        tree_insert(e->t, i+1, texts[i], e->command_id, e->undo_stack);
+    editor_add_level(e);
+    free(texts);
+
+    return e;
+}
+
+void bench_editor_destroy(editor_t* e)
+{
+    editor_destroy(e);
+    free(e);
+}
+
+void bench_insert_sequential(int n)
+{
+    editor_t* e = (editor_t*) malloc(sizeof(editor_t));
+    char** texts = bench_texts(n);
+    bench_timer_t timer;
+    int i;
+
+    editor_create(e);
+    bench_start(&timer);
+    for (i = 0; i < n; i++)
+        tree_insert(e->t, i+1, texts[i], e->command_id, e->undo_stack);
+    bench_stop(&timer, "insert_sequential", n);
+    free(texts);
+    bench_editor_destroy(e);
+}
+
+void bench_change_random(int n)
+{
+    editor_t* e = bench_editor(n);
+    char** texts = bench_texts(n);
+    int* keys = (int*) malloc(n * sizeof(int));
+    bench_timer_t timer;
+    int i;
+
+    for (i = 0; i < n; i++)
+        keys[i] = 1 + rand() % n;
+    bench_start(&timer);
+    for (i = 0; i < n; i++)
+        tree_insert(e->t, keys[i], texts[i], e->command_id, e->undo_stack);
+    bench_stop(&timer, "change_random", n);
+    free(keys);
+    free(texts);
+    bench_editor_destroy(e);
+}
+
+void bench_search_random(int n)
+{
+    editor_t* e = bench_editor(n);
+    int* keys = (int*) malloc(n * sizeof(int));
+    bench_timer_t timer;
+    long found = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        keys[i] = 1 + rand() % n;
+    bench_start(&timer);
+    for (i = 0; i < n; i++)
+        found += tree_search(e->t, keys[i]) != NULL;
+    bench_stop(&timer, "search_random", n);
+    if (found != n)
+        fprintf(stderr, "search_random: %ld keys found out of %d\n", found, n);
+    free(keys);
+    bench_editor_destroy(e);
+}
+
+void bench_print_long(int n)
+{
+    editor_t* e = bench_editor(n);
+    bench_timer_t timer;
+    node_t* x;
+    long bytes = 0;
+    int i;
+
+    //the walk of a print of the whole document, without the output
+    bench_start(&timer);
+    for (i = 0, x = tree_search(e->t, 1); i < n; i++, x = tree_successor(e->t, x))
+        bytes += x->text_line[0];
+    bench_stop(&timer, "print_long", n);
+    if (bytes == 0)
+        fprintf(stderr, "print_long: empty document\n");
+    bench_editor_destroy(e);
+}
+
+void bench_delete_range(int n, int width)
+{
+    editor_t* e = bench_editor(n);
+    command_batch_t* b = batch_create();
+    command_t cmd;
+    bench_timer_t timer;
+    char name[32];
+    int deletes = n / (2*width);
+    int* starts = (int*) malloc((deletes > 0 ? deletes : 1) * sizeof(int));
+    int i, size = n;
+
+    for (i = 0; i < deletes; i++, size -= width)
+        starts[i] = 1 + rand() % (size - width + 1);
+    cmd.command = DELETE;
+    cmd.first_line = 0;
+    bench_start(&timer);
+    for (i = 0; i < deletes; i++){
+        cmd.start = starts[i];
+        cmd.end = starts[i] + width - 1;
+        editor_execute(e, b, &cmd);
+    }
+    tree_apply_key_shifts(e->t); //the shifts logged by the deletes are part of their cost
+    snprintf(name, sizeof(name), "delete_range_%d", width);
+    bench_stop(&timer, name, deletes);
+    free(starts);
+    batch_destroy(b);
+    bench_editor_destroy(e);
+}
+
+void bench_undo_deep(int n)
+{
+    editor_t* e = bench_editor(n);
+    command_batch_t* b = batch_create();
+    command_t cmd;
+    bench_timer_t timer;
+    int i;
+
+    free(b->text_lines);
+    b->text_lines = bench_texts(n);
+    cmd.command = CHANGE;
+    for (i = 0; i < n; i++){ //a level for every change of a line
+        cmd.start = cmd.end = 1 + rand() % n;
+        cmd.first_line = i;
+        editor_execute(e, b, &cmd);
+    }
+    tree_apply_key_shifts(e->t);
+
+    bench_start(&timer);
+    for (i = 0; i < n; i++)
+        editor_undo_level(e);
+    bench_stop(&timer, "undo_deep", n);
+    bench_start(&timer);
+    for (i = 0; i < n; i++)
+        editor_redo_level(e);
+    bench_stop(&timer, "redo_deep", n);
+    batch_destroy(b);
+    bench_editor_destroy(e);
+}
+
+void bench_teardown(int n)
+{
+    editor_t* e = bench_editor(n);
+    bench_timer_t timer;
+
+    bench_start(&timer);
+    editor_destroy(e);
+    bench_stop(&timer, "teardown", n);
+    free(e);
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : BENCH_OPERATIONS;
+
+    if (n < 1)
+        n = BENCH_OPERATIONS;
+    srand(BENCH_SEED);
+    printf("benchmark,operations,ns_per_op,cache_misses_per_op\n");
+    bench_insert_sequential(n);
+    bench_change_random(n);
+    bench_search_random(n);
+    bench_print_long(n);
+    bench_delete_range(n, 1);
+    bench_delete_range(n, 16);
+    bench_delete_range(n, 256);
+    bench_undo_deep(n);
+    bench_teardown(n);
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Replays a trace written by the editor with the EDITOR_TRACE environment variable set.
+ * The commands are executed as fast as possible, or at the pacing in which they arrived with "paced". For every type of command it prints a line of comma
+ * separated values with the latencies (from arrival to completion) of the trace and of the replay: count, then median, 99th percentile and maximum in
+ * nanoseconds. The undo-s and redo-s applied before a command are a type of their own ("a"), the lines closing the text of a change (".") are not counted.
+ * The output of every command is compared with the one of the trace, the commands whose output differs are listed on stderr.
+ * The saves write in a scratch directory, removed at the end, instead of the files named in the trace.
+ * Usage: replay trace [paced]
+ */
+#define EDITOR_NO_MAIN
+#include "main.c"
+
+/* ------------------------------------------------------------------------------------------ constants ------------------------------------------------------------------------------------------ */
+#define REPLAY_MAX_MISMATCHES 10 //commands with a different output listed on stderr
+#define REPLAY_SPIN_NS 200000 //in a paced replay the last part of the wait for a command is spent spinning
+#define REPLAY_SCRATCH "/tmp/replay_XXXXXX" //directory of the files written by the saves
+
+/* ------------------------------------------------------------------------------------------ structs ------------------------------------------------------------------------------------------ */
+/**
+ * Latencies of the commands of a type
+ */
+typedef struct latencies_s{
+    long long* traced;
+    long long* replayed;
+    int size;
+    int capacity;
+} latencies_t;
+
+/* ------------------------------------------------------------------------------------------ replay prototypes ------------------------------------------------------------------------------------------ */
+/**
+ * Adds the latencies of a command
+ * @param l latencies of the type of the command
+ * @param traced latency in the trace
+ * @param replayed latency in the replay
+ */
+void latencies_add(latencies_t* l, long long traced, long long replayed);
+
+/**
+ * Prints count, median, 99th percentile and maximum of the latencies of a type, sorting them
+ * @param f file in which they are printed
+ * @param name name of the type
+ * @param l latencies
+ */
+void latencies_print(FILE* f, const char* name, latencies_t* l);
+
+/* ------------------------------------------------------------------------------------------ functions ------------------------------------------------------------------------------------------ */
+int compare_long_long(const void* a, const void* b)
+{
+    return (*(const long long*) a > *(const long long*) b) - (*(const long long*) a < *(const long long*) b);
+}
+
+void latencies_add(latencies_t* l, long long traced, long long replayed)
+{
+    if (l->size == l->capacity){
+        l->capacity = l->capacity ? 2*l->capacity : 1024;
+        l->traced = (long long*) realloc(l->traced, l->capacity * sizeof(long long));
+        l->replayed = (long long*) realloc(l->replayed, l->capacity * sizeof(long long));
+    }
+    l->traced[l->size] = traced;
+    l->replayed[l->size] = replayed;
+    l->size++;
+}
+
+void latencies_print(FILE* f, const char* name, latencies_t* l)
+{
+    int n = l->size;
+
+    qsort(l->traced, n, sizeof(long long), compare_long_long);
+    qsort(l->replayed, n, sizeof(long long), compare_long_long);
+    fprintf(f, "%s,%d,%lld,%lld,%lld,%lld,%lld,%lld\n", name, n,
+            l->traced[(n-1)/2], l->traced[(long) (n-1)*99/100], l->traced[n-1],
+            l->replayed[(n-1)/2], l->replayed[(long) (n-1)*99/100], l->replayed[n-1]);
+}
+
+int main(int argc, char** argv)
+{
+    latencies_t* latencies = (latencies_t*) calloc(256, sizeof(latencies_t)); //indexed by command
+    latencies_t all = {NULL, NULL, 0, 0};
+    editor_t* e = (editor_t*) malloc(sizeof(editor_t));
+    command_batch_t* b = batch_create();
+    trace_record_t record;
+    struct timespec wake;
+    char magic[sizeof(TRACE_MAGIC)] = {0};
+    char name[2] = {0, 0};
+    char scratch[] = REPLAY_SCRATCH;
+    char scratch_file[sizeof(REPLAY_SCRATCH) + 16];
+    const char* failed = "?\n";
+    unsigned long long failed_hash = FNV_OFFSET; //hash of the output of a save that could not write its file
+    long long first_arrival = 0, replay_start = 0, arrival, completion, target;
+    long commands = 0, mismatches = 0;
+    int paced = argc > 2 && strcmp(argv[2], "paced") == 0;
+    FILE* report;
+    FILE* f;
+    int c;
+
+    if (argc < 2){
+        fprintf(stderr, "Usage: %s trace [paced]\n", argv[0]);
+        return 2;
+    }
+    f = fopen(argv[1], "rb");
+    if (!f || fread(magic, 1, strlen(TRACE_MAGIC), f) != strlen(TRACE_MAGIC) || strcmp(magic, TRACE_MAGIC) != 0){
+        fprintf(stderr, "%s is not a trace\n", argv[1]);
+        return 2;
+    }
+
+    //the output of the editor is only hashed: the report takes the place of stdout
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)){
+        fprintf(stderr, "Cannot redirect the output of the editor\n");
+        return 2;
+    }
+    if (!mkdtemp(scratch)){
+        fprintf(stderr, "Cannot create the scratch directory\n");
+        return 2;
+    }
+    for (c = 0; failed[c]; c++)
+        failed_hash = (failed_hash ^ (unsigned char) failed[c]) * FNV_PRIME;
+    unsetenv("EDITOR_TRACE");
+    editor_create(e);
+    e->output.traced = 1;
+    e->output.interactive = 0;
+
+    while (trace_read_record(f, &record, b)){
+        if (commands == 0){
+            first_arrival = record.arrival_ns;
+            replay_start = monotonic_ns();
+        }
+        if (paced){ //the command arrives at the same distance from the first one as in the trace
+            target = replay_start + (record.arrival_ns - first_arrival);
+            if (target - monotonic_ns() > REPLAY_SPIN_NS){
+                wake.tv_sec = (target - REPLAY_SPIN_NS) / 1000000000LL;
+                wake.tv_nsec = (target - REPLAY_SPIN_NS) % 1000000000LL;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0)
+                    ;
+            }
+            while (monotonic_ns() < target) //the wake up of a sleep is too late for the gaps between commands
+                ;
+            arrival = target;
+        } else
+            arrival = monotonic_ns();
+
+        if (record.command == WRITE){ //the document is saved in the scratch directory, never over the file named in the trace
+            //a save that failed in the trace is sent to a directory that does not exist, so that it fails again
+            snprintf(scratch_file, sizeof(scratch_file), "%s/%s", scratch,
+                     record.output_hash == failed_hash && record.output_bytes == (long long) strlen(failed) ? "missing/save" : "save");
+            free(b->text_lines[0]);
+            b->text_lines[0] = (char*) malloc(strlen(scratch_file) + 2);
+            sprintf(b->text_lines[0], "%s\n", scratch_file);
+        }
+        e->output.trace_hash = FNV_OFFSET;
+        e->output.trace_bytes = 0;
+        if (record.command == TRACE_APPLY_DO){ //the history summed up by the previous records is applied, like in the trace, before the next command
+            if (e->do_pending)
+                editor_apply_do(e);
+        } else
+            editor_execute(e, b, &b->commands[0]);
+        if (record.command == WRITE)
+            unlink(scratch_file);
+        output_trace(&e->output);
+        completion = monotonic_ns();
+
+        if (e->output.trace_hash != record.output_hash || e->output.trace_bytes != record.output_bytes){
+            if (mismatches < REPLAY_MAX_MISMATCHES)
+                fprintf(stderr, "command %ld (%c): %lld bytes of output, %lld in the trace\n", commands, record.command, e->output.trace_bytes, record.output_bytes);
+            mismatches++;
+        }
+        if (record.command == POINT) //the line closing the text of a change is read like a command, but it is not one
+            continue;
+        latencies_add(&latencies[(unsigned char) record.command], record.completion_ns - record.arrival_ns, completion - arrival);
+        latencies_add(&all, record.completion_ns - record.arrival_ns, completion - arrival);
+        commands++;
+        if (record.command == QUIT)
+            break;
+    }
+    output_flush(&e->output);
+    rmdir(scratch);
+    batch_destroy(b);
+    editor_destroy(e); //unlike the editor, the replay frees the history, so that a leak checker can run on it
+    free(e);
+
+    fprintf(report, "command,count,trace_p50_ns,trace_p99_ns,trace_max_ns,replay_p50_ns,replay_p99_ns,replay_max_ns\n");
+    for (c = 0; c < 256; c++){
+        if (latencies[c].size > 0){
+            name[0] = (char) c;
+            latencies_print(report, c == ',' ? "\",\"" : name, &latencies[c]);
+        }
+    }
+    if (all.size > 0)
+        latencies_print(report, "all", &all);
+    fclose(report);
+    for (c = 0; c < 256; c++){
+        free(latencies[c].traced);
+        free(latencies[c].replayed);
+    }
+    free(latencies);
+    free(all.traced);
+    free(all.replayed);
+    if (mismatches > 0)
+        fprintf(stderr, "%ld commands out of %ld with a different output\n", mismatches, commands);
+
+    return mismatches > 0;
+}
@@ -0,0 +1,10 @@
+# Runs the editor on the input of a test and compares its output with the expected one
+# Usage: cmake -DEDITOR=<editor> -DINPUT=<name>_input.txt -DOUTPUT=<name>_output.txt -P compare_output.cmake
+execute_process(COMMAND "${EDITOR}" INPUT_FILE "${INPUT}" OUTPUT_VARIABLE ACTUAL RESULT_VARIABLE RESULT)
+if (NOT RESULT EQUAL 0)
+    message(FATAL_ERROR "${EDITOR} exited with ${RESULT} on ${INPUT}")
+endif ()
+file(READ "${OUTPUT}" EXPECTED)
+if (NOT ACTUAL STREQUAL EXPECTED)
+    message(FATAL_ERROR "The output of ${INPUT} differs from ${OUTPUT}")
+endif ()